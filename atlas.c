@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <pango/pangocairo.h>
+#include "atlas.h"
+
+void atlas_init(Atlas *a, PangoContext *context) {
+    a->context = context;
+    a->layout = pango_layout_new(context);
+    a->ok = false;
+    a->advance = 0;
+    a->lineheight = 0;
+    a->pad = 0;
+    a->cellw = 0;
+    a->cellh = 0;
+    a->surface = NULL;
+    a->ncolors = 0;
+    a->clock = 0;
+}
+
+void atlas_free(Atlas *a) {
+    if (a->surface != NULL) {
+        cairo_surface_destroy(a->surface);
+    }
+    g_object_unref(a->layout);
+    a->surface = NULL;
+    a->layout = NULL;
+    a->ok = false;
+}
+
+// Throws away all the glyphs and measures the new font.
+// The atlas is only used if every printable ascii glyph
+// has the same advance.
+void atlas_setfont(Atlas *a, const PangoFontDescription *font) {
+    PangoRectangle logical;
+    char c;
+    int width = -1, height = 0;
+
+    if (a->surface != NULL) {
+        cairo_surface_destroy(a->surface);
+        a->surface = NULL;
+    }
+    a->ncolors = 0;
+    a->ok = false;
+
+    pango_layout_set_font_description(a->layout, font);
+    for (c = AtlasFirst; c < AtlasFirst + AtlasGlyphs; c++) {
+        pango_layout_set_text(a->layout, &c, 1);
+        pango_layout_get_extents(a->layout, NULL, &logical);
+        if (width >= 0 && logical.width != width) {
+            return;
+        }
+        width = logical.width;
+        if (logical.height > height) {
+            height = logical.height;
+        }
+    }
+    a->advance = pango_units_to_double(width);
+    a->lineheight = PANGO_PIXELS_CEIL(height);
+    a->pad = a->lineheight/4 + 1;
+    a->cellw = ceil(a->advance) + 2*a->pad;
+    a->cellh = a->lineheight + 2*a->pad;
+    a->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+        a->cellw * AtlasGlyphs, a->cellh * AtlasColors);
+    if (cairo_surface_status(a->surface) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "atlas: couldn't create surface\n");
+        cairo_surface_destroy(a->surface);
+        a->surface = NULL;
+        return;
+    }
+    a->ok = true;
+}
+
+// Reports whether a line can be drawn from the atlas:
+// it's all printable ascii and fits in width (pango units) without wrapping.
+bool atlas_fits(Atlas *a, const char *s, size_t len, int width) {
+    size_t i;
+    if (!a->ok) {
+        return false;
+    }
+    if (width >= 0 && len * a->advance * PANGO_SCALE > width) {
+        return false;
+    }
+    for (i = 0; i < len; i++) {
+        if ((unsigned)((unsigned char)s[i] - AtlasFirst) >= AtlasGlyphs) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int atlas_lineheight(Atlas *a) {
+    return a->lineheight;
+}
+
+// Returns the row for a color, taking over the least recently used one.
+static int atlas_color(Atlas *a, cairo_pattern_t *fg) {
+    double r = 0, g = 0, b = 0, alpha = 1;
+    int i, lru;
+
+    cairo_pattern_get_rgba(fg, &r, &g, &b, &alpha);
+    lru = 0;
+    for (i = 0; i < a->ncolors; i++) {
+        if (a->colors[i].r == r && a->colors[i].g == g &&
+            a->colors[i].b == b && a->colors[i].a == alpha) {
+            a->colors[i].used = ++a->clock;
+            return i;
+        }
+        if (a->colors[i].used < a->colors[lru].used) {
+            lru = i;
+        }
+    }
+    if (a->ncolors < AtlasColors) {
+        lru = a->ncolors++;
+    }
+    a->colors[lru].r = r;
+    a->colors[lru].g = g;
+    a->colors[lru].b = b;
+    a->colors[lru].a = alpha;
+    a->colors[lru].used = ++a->clock;
+    memset(a->ready[lru], 0, sizeof a->ready[lru]);
+    return lru;
+}
+
+static void atlas_rasterize(Atlas *a, int row, int glyph) {
+    cairo_t *cr;
+    char c = AtlasFirst + glyph;
+    int x = glyph * a->cellw;
+    int y = row * a->cellh;
+
+    cr = cairo_create(a->surface);
+    cairo_rectangle(cr, x, y, a->cellw, a->cellh);
+    cairo_clip(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+    cairo_set_source_rgba(cr, a->colors[row].r, a->colors[row].g,
+        a->colors[row].b, a->colors[row].a);
+    pango_layout_set_text(a->layout, &c, 1);
+    cairo_move_to(cr, x + a->pad, y + a->pad);
+    pango_cairo_show_layout(cr, a->layout);
+    cairo_destroy(cr);
+    a->ready[row][glyph] = true;
+}
+
+// Draws a line that atlas_fits, with its top left corner at (x, y).
+void atlas_draw(Atlas *a, cairo_t *cr, cairo_pattern_t *fg, double x, double y, const char *s, size_t len) {
+    double gx, gy;
+    int row, glyph;
+    size_t i;
+
+    row = atlas_color(a, fg);
+    gy = round(y) - a->pad;
+    for (i = 0; i < len; i++) {
+        if (s[i] == ' ') {
+            continue;
+        }
+        glyph = (unsigned char)s[i] - AtlasFirst;
+        if (!a->ready[row][glyph]) {
+            atlas_rasterize(a, row, glyph);
+        }
+        gx = round(x + i * a->advance) - a->pad;
+        cairo_set_source_surface(cr, a->surface,
+            gx - glyph * a->cellw, gy - row * a->cellh);
+        cairo_rectangle(cr, gx, gy, a->cellw, a->cellh);
+        cairo_fill(cr);
+    }
+    cairo_set_source(cr, fg);
+}
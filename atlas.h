@@ -0,0 +1,42 @@
+//#include <stdbool.h> /* bool */
+//#include <pango/pangocairo.h>
+
+// Atlas:
+//   pre-rasterized printable ascii glyphs for one monospace font,
+//   so that simple lines can be drawn without pango
+//   one row of glyphs per color
+
+enum {
+    AtlasFirst = 0x20, // first glyph in the atlas
+    AtlasGlyphs = 0x7F - AtlasFirst, // printable ascii
+    AtlasColors = 8, // colors to keep around
+};
+
+typedef struct Atlas Atlas;
+
+struct Atlas {
+    PangoContext *context;
+    PangoLayout *layout; // for rasterizing glyphs
+    bool ok; // the font is monospace, so the atlas can be used
+    double advance; // width of every glyph, in pixels
+    int lineheight; // height of a line, in pixels
+    int pad; // room for ink outside the logical box
+    int cellw; // size of a glyph's cell in the surface, pad included
+    int cellh;
+    cairo_surface_t *surface;
+
+    struct {
+        double r, g, b, a;
+        unsigned long used;
+    } colors[AtlasColors];
+    int ncolors;
+    unsigned long clock;
+    bool ready[AtlasColors][AtlasGlyphs]; // glyph has been rasterized
+};
+
+void atlas_init(Atlas *a, PangoContext *context);
+void atlas_free(Atlas *a);
+void atlas_setfont(Atlas *a, const PangoFontDescription *font);
+bool atlas_fits(Atlas *a, const char *s, size_t len, int width);
+int atlas_lineheight(Atlas *a);
+void atlas_draw(Atlas *a, cairo_t *cr, cairo_pattern_t *fg, double x, double y, const char *s, size_t len);
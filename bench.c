@@ -0,0 +1,538 @@
+// Replays pty output through the ingest, parse, scrollback and layout
+// path and draws frames to an image surface, without X or a shell.
+//
+// usage: termbench [-F] [-f font] [-n bytes] [-r frame-bytes] [stream|file...]
+//        termbench -p
+//
+// With no arguments, runs every built-in stream.
+// -F replays in flood mode, the way the terminal would see these streams.
+// -p times starting jobs instead, against the size of our heap.
+// Prints one JSON object per stream (or heap size) on stdout.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <pango/pangocairo.h>
+#include "utf8.h"
+#include "hist.h"
+#include "path.h"
+#include "shell.h"
+#include "vt.h"
+#include "atlas.h"
+#include "sums.h"
+#include "render.h"
+#include "view.h"
+#include "block.h"
+
+const size_t hist_limit = 256<<20; // same as the terminal
+const size_t readbuf_size = 64*1024; // same as the terminal
+const int width = 800;
+const int height = 600;
+
+size_t stream_limit = 64<<20; // bytes per stream
+size_t frame_bytes = 1<<20; // bytes of input between frames
+const char *fontname = "Monospace 10";
+bool flood;
+bool spawns; // -p
+
+typedef struct Buf Buf;
+
+struct Buf {
+    char *p;
+    size_t len;
+    size_t cap;
+};
+
+void buf_append(Buf *b, const char *s, size_t len) {
+    if (b->len + len > b->cap) {
+        void *v;
+        size_t newcap = b->cap * 2;
+        if (newcap < b->len + len) {
+            newcap = b->len + len;
+        }
+        v = realloc(b->p, newcap);
+        if (v == NULL) {
+            perror("bench: realloc");
+            exit(1);
+        }
+        b->p = v;
+        b->cap = newcap;
+    }
+    memcpy(b->p + b->len, s, len);
+    b->len += len;
+}
+
+void buf_puts(Buf *b, const char *s) {
+    buf_append(b, s, strlen(s));
+}
+
+bool buf_full(Buf *b) {
+    return b->len >= stream_limit;
+}
+
+// Built-in streams
+
+void gen_yes(Buf *b) {
+    while (!buf_full(b)) {
+        buf_puts(b, "y\n");
+    }
+}
+
+void gen_seq(Buf *b) {
+    char line[32];
+    long i;
+    for (i = 1; i <= 10000000 && !buf_full(b); i++) {
+        snprintf(line, sizeof line, "%ld\n", i);
+        buf_puts(b, line);
+    }
+}
+
+// Looks like gcc output with colors on.
+void gen_color(Buf *b) {
+    char line[256];
+    long i;
+    for (i = 0; !buf_full(b); i++) {
+        snprintf(line, sizeof line,
+            "\x1b[01m\x1b[Ksrc/module%ld.c:%ld:%ld:\x1b[m\x1b[K "
+            "\x1b[01;31m\x1b[Kerror: \x1b[m\x1b[Kexpected '\x1b[01m\x1b[K;\x1b[m\x1b[K' before '\x1b[01m\x1b[K}\x1b[m\x1b[K' token\n"
+            "  %ld |     return x\n"
+            "      |             \x1b[01;31m\x1b[K^\x1b[m\x1b[K\n",
+            i % 97, i % 1000 + 1, i % 80 + 1, i % 1000 + 1);
+        buf_puts(b, line);
+    }
+}
+
+void gen_cjk(Buf *b) {
+    static const char *words[] = {
+        "ポケモン", "ポケットモンスター", "日本語", "中文字符", "한국어",
+        "端末", "文字化け", "漢字", "、", "。",
+    };
+    long i;
+    for (i = 0; !buf_full(b); i++) {
+        buf_puts(b, words[i % 10]);
+        if (i % 17 == 16) {
+            buf_puts(b, "\n");
+        }
+    }
+}
+
+// 8 KiB lines that have to wrap.
+void gen_longlines(Buf *b) {
+    static const char *words = "the quick brown fox jumps over the lazy dog ";
+    size_t n;
+    while (!buf_full(b)) {
+        for (n = 0; n < 8192; n += strlen(words)) {
+            buf_puts(b, words);
+        }
+        buf_puts(b, "\n");
+    }
+}
+
+struct {
+    const char *name;
+    void (*gen)(Buf *b);
+} streams[] = {
+    {"yes", gen_yes},
+    {"seq", gen_seq},
+    {"color", gen_color},
+    {"cjk", gen_cjk},
+    {"longlines", gen_longlines},
+};
+
+int read_file(Buf *b, const char *name) {
+    char chunk[64*1024];
+    size_t n;
+    FILE *f = fopen(name, "rb");
+    if (f == NULL) {
+        perror(name);
+        return -1;
+    }
+    while (!buf_full(b) && (n = fread(chunk, 1, sizeof chunk, f)) > 0) {
+        buf_append(b, chunk, n);
+    }
+    fclose(f);
+    return 0;
+}
+
+// The path the terminal takes
+
+typedef struct Replay Replay;
+
+struct Replay {
+    Job *job;
+    Vt vt;
+    char *readbuf;
+    char *fixbuf;
+    size_t npartial;
+};
+
+void replay_vtaction(void *arg, VtAction *a) {
+    Replay *r = arg;
+    if (a->type == VtText) {
+        job_appendhist(r->job, a->s, a->len);
+    }
+}
+
+// Same as term_ingest: len bytes at the start of readbuf.
+void replay_ingest(Replay *r, size_t len) {
+    size_t end, n;
+    end = utf8complete(r->readbuf, len);
+    if (utf8valid(r->readbuf, end) != end) {
+        n = utf8fix(r->fixbuf, r->readbuf, end);
+        vt_parse(&r->vt, r->fixbuf, n);
+    } else {
+        vt_parse(&r->vt, r->readbuf, end);
+    }
+    r->npartial = len - end;
+    memmove(r->readbuf, r->readbuf + end, r->npartial);
+}
+
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+int cmpdouble(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double *v, int n, double p) {
+    int i;
+    if (n == 0) {
+        return 0;
+    }
+    i = p * (n - 1) + 0.5;
+    return v[i];
+}
+
+// Draws a frame the way the terminal does, all of it damaged:
+// copies it into a scene and paints that, on this thread.
+void draw_frame(Render *rd, Scene *s, Blocks *bl, long *scroll) {
+    cairo_rectangle_int_t all = {0, 0, width, height};
+    long h;
+    int x, y;
+    blocks_update(bl);
+    blocks_changed(bl);
+    // follow the output, like a terminal scrolled to the bottom
+    h = blocks_height(bl);
+    *scroll = h > height ? h - height : 0;
+    scene_clear(s);
+    s->damage = cairo_region_create_rectangle(&all);
+    blocks_snap(bl, s, 2 - *scroll, height);
+    blocks_endpos(bl, &x, &y);
+    s->inputx = 2 + x;
+    s->inputy = 2 + y - *scroll;
+    render_draw(rd, s);
+    blocks_measured(bl, s);
+}
+
+void run(const char *name, Buf *in) {
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    PangoLayout *layout;
+    PangoFontDescription *desc;
+    PangoFontMetrics *metrics;
+    Atlas atlas;
+    Blocks bl;
+    Render rd;
+    Scene scene;
+    Replay r;
+    struct rusage ru;
+    double start, t0, total, *frames;
+    size_t off, n, since;
+    long scroll = 0, base;
+    int nframes, framecap;
+
+    // The input is built by now and is most of the peak so far.
+    // Only what the terminal adds on top of it is reported.
+    getrusage(RUSAGE_SELF, &ru);
+    base = ru.ru_maxrss;
+
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cr = cairo_create(surface);
+    layout = pango_cairo_create_layout(cr);
+    if (render_init(&rd, NULL) < 0) {
+        exit(1);
+    }
+    scene_init(&scene);
+    scene.width = width;
+    scene.height = height;
+    scene.fg[0] = scene.fg[1] = scene.fg[2] = 0;
+    scene.fg[3] = 1;
+    scene.bg[0] = scene.bg[1] = 1;
+    scene.bg[2] = 0xd5/255.0;
+    scene.bg[3] = 1;
+    scene.wrap = (width - 4)*PANGO_SCALE;
+    scene.border = 2;
+
+    desc = pango_font_description_from_string(fontname);
+    metrics = pango_context_get_metrics(pango_layout_get_context(layout), desc, NULL);
+    atlas_init(&atlas, pango_layout_get_context(layout));
+    atlas_setfont(&atlas, desc);
+    blocks_init(&bl, pango_layout_get_context(layout), &atlas);
+    blocks_setfont(&bl, desc,
+        pango_units_to_double(pango_font_metrics_get_approximate_char_width(metrics)),
+        pango_units_to_double(pango_font_metrics_get_ascent(metrics) +
+            pango_font_metrics_get_descent(metrics)));
+    blocks_setwidth(&bl, (width - 4)*PANGO_SCALE);
+    scene_setfonts(&scene, desc, desc);
+    scene.charwidth = bl.charwidth;
+    pango_font_metrics_unref(metrics);
+    pango_font_description_free(desc);
+
+    r.job = job_create((char*)name);
+    if (r.job == NULL) {
+        exit(1);
+    }
+    r.job->running = true;
+    hist_setlimit(&r.job->hist, hist_limit);
+    blocks_setflood(&bl, flood);
+    blocks_add(&bl, r.job);
+    vt_init(&r.vt, replay_vtaction, &r);
+    r.readbuf = malloc(readbuf_size);
+    r.fixbuf = malloc(3*readbuf_size);
+    r.npartial = 0;
+    if (r.readbuf == NULL || r.fixbuf == NULL) {
+        perror("bench: malloc");
+        exit(1);
+    }
+
+    framecap = in->len / frame_bytes + 2;
+    frames = malloc(framecap * sizeof frames[0]);
+    if (frames == NULL) {
+        perror("bench: malloc");
+        exit(1);
+    }
+    nframes = 0;
+
+    start = now_ms();
+    since = 0;
+    for (off = 0; off < in->len; off += n) {
+        n = readbuf_size - r.npartial;
+        if (n > in->len - off) {
+            n = in->len - off;
+        }
+        memcpy(r.readbuf + r.npartial, in->p + off, n);
+        replay_ingest(&r, r.npartial + n);
+        since += n;
+        if (since >= frame_bytes && nframes < framecap) {
+            t0 = now_ms();
+            draw_frame(&rd, &scene, &bl, &scroll);
+            frames[nframes++] = now_ms() - t0;
+            since = 0;
+        }
+    }
+    if (nframes < framecap) {
+        t0 = now_ms();
+        draw_frame(&rd, &scene, &bl, &scroll);
+        frames[nframes++] = now_ms() - t0;
+    }
+    total = now_ms() - start;
+
+    qsort(frames, nframes, sizeof frames[0], cmpdouble);
+    getrusage(RUSAGE_SELF, &ru);
+    printf("{\"stream\": \"%s\", \"flood\": %s, \"bytes\": %zu, \"seconds\": %.3f, \"mb_per_s\": %.1f, "
+        "\"frames\": %d, \"frame_ms_p50\": %.3f, \"frame_ms_p90\": %.3f, "
+        "\"frame_ms_p99\": %.3f, \"frame_ms_max\": %.3f, \"peak_rss_kb\": %ld, \"input_rss_kb\": %ld}\n",
+        name, flood ? "true" : "false", in->len, total/1e3, in->len / (total/1e3) / 1e6,
+        nframes, percentile(frames, nframes, 0.5), percentile(frames, nframes, 0.9),
+        percentile(frames, nframes, 0.99), frames[nframes-1], ru.ru_maxrss - base, base);
+    fflush(stdout);
+}
+
+// Runs a stream in a child process, so that peak RSS is its own.
+// peak_rss_kb leaves out the input, which run measures before starting.
+int bench(const char *arg) {
+    Buf in = {NULL, 0, 0};
+    const char *name = arg;
+    pid_t pid;
+    size_t i;
+    int status;
+
+    pid = fork();
+    if (pid < 0) {
+        perror("bench: fork");
+        return -1;
+    }
+    if (pid > 0) {
+        if (waitpid(pid, &status, 0) < 0) {
+            perror("bench: waitpid");
+            return -1;
+        }
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+    }
+
+    for (i = 0; i < sizeof streams / sizeof streams[0]; i++) {
+        if (strcmp(arg, streams[i].name) == 0) {
+            streams[i].gen(&in);
+            break;
+        }
+    }
+    if (i == sizeof streams / sizeof streams[0]) {
+        if (read_file(&in, arg) < 0) {
+            exit(1);
+        }
+        name = strrchr(arg, '/') ? strrchr(arg, '/') + 1 : arg;
+    }
+    if (in.len == 0) {
+        fprintf(stderr, "%s: empty stream\n", arg);
+        exit(1);
+    }
+    run(name, &in);
+    exit(0);
+}
+
+// Process launch
+
+enum {
+    SpawnRuns = 200,
+};
+
+// Times starting "true" on a pty the way the terminal starts jobs,
+// and with plain fork and exec, both until the child has been reaped.
+// Runs in a child with heap bytes allocated and touched,
+// since fork's cost grows with the heap.
+void spawn(size_t heap) {
+    static char *argv[] = {"true", NULL};
+    double jobs[SpawnRuns], forks[SpawnRuns], t0;
+    Shell sh;
+    Job *job;
+    pid_t pid;
+    char *p;
+    int i, status;
+
+    p = malloc(heap + 1);
+    if (p == NULL) {
+        perror("spawn: malloc");
+        exit(1);
+    }
+    memset(p, 1, heap + 1);
+    if (shell_init(&sh) < 0) {
+        exit(1);
+    }
+
+    for (i = 0; i < SpawnRuns; i++) {
+        job = job_create("true");
+        if (job == NULL) {
+            exit(1);
+        }
+        t0 = now_ms();
+        if (job_start(job, &sh) < 0) {
+            exit(1);
+        }
+        waitpid(job->pid, &status, 0);
+        jobs[i] = now_ms() - t0;
+        job_close(job);
+        free(job->cmdline);
+        hist_free(&job->hist);
+        free(job);
+
+        t0 = now_ms();
+        pid = fork();
+        if (pid == 0) {
+            execv("/bin/true", argv);
+            _exit(127);
+        }
+        waitpid(pid, &status, 0);
+        forks[i] = now_ms() - t0;
+    }
+
+    qsort(jobs, SpawnRuns, sizeof jobs[0], cmpdouble);
+    qsort(forks, SpawnRuns, sizeof forks[0], cmpdouble);
+    printf("{\"spawn\": \"true\", \"heap_mb\": %zu, \"runs\": %d, "
+        "\"job_us_p50\": %.1f, \"job_us_p99\": %.1f, "
+        "\"fork_us_p50\": %.1f, \"fork_us_p99\": %.1f}\n",
+        heap >> 20, SpawnRuns,
+        percentile(jobs, SpawnRuns, 0.5) * 1e3, percentile(jobs, SpawnRuns, 0.99) * 1e3,
+        percentile(forks, SpawnRuns, 0.5) * 1e3, percentile(forks, SpawnRuns, 0.99) * 1e3);
+    fflush(stdout);
+    shell_exit(&sh);
+    free(p);
+}
+
+int bench_spawn(void) {
+    static const size_t heaps[] = {0, 64<<20, 256<<20, 1024<<20};
+    pid_t pid;
+    size_t i;
+    int status, err;
+
+    err = 0;
+    for (i = 0; i < sizeof heaps / sizeof heaps[0]; i++) {
+        pid = fork();
+        if (pid < 0) {
+            perror("bench: fork");
+            return -1;
+        }
+        if (pid == 0) {
+            spawn(heaps[i]);
+            exit(0);
+        }
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            err = -1;
+        }
+    }
+    return err;
+}
+
+void usage(void) {
+    fprintf(stderr, "usage: termbench [-F] [-f font] [-n bytes] [-r frame-bytes] [stream|file...]\n");
+    fprintf(stderr, "       termbench -p\n");
+    fprintf(stderr, "streams: yes seq color cjk longlines\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    size_t i;
+    int c, err;
+
+    while ((c = getopt(argc, argv, "Ff:n:pr:")) != -1) {
+        switch (c) {
+        case 'F':
+            flood = true;
+            break;
+        case 'p':
+            spawns = true;
+            break;
+        case 'f':
+            fontname = optarg;
+            break;
+        case 'n':
+            stream_limit = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            frame_bytes = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (frame_bytes == 0) {
+        usage();
+    }
+    if (spawns) {
+        return bench_spawn() < 0 ? 1 : 0;
+    }
+
+    err = 0;
+    if (optind == argc) {
+        for (i = 0; i < sizeof streams / sizeof streams[0]; i++) {
+            err |= bench(streams[i].name);
+        }
+    }
+    for (; optind < argc; optind++) {
+        err |= bench(argv[optind]);
+    }
+    return err ? 1 : 0;
+}
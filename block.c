@@ -0,0 +1,546 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <pango/pangocairo.h>
+#include "hist.h"
+#include "path.h"
+#include "shell.h"
+#include "atlas.h"
+#include "sums.h"
+#include "render.h"
+#include "view.h"
+#include "block.h"
+
+static const char prompt[] = "% ";
+static const char selprompt[] = "» "; // header of the job that gets input
+
+void blocks_init(Blocks *bl, PangoContext *context, Atlas *atlas) {
+    bl->blocks = NULL;
+    bl->nblocks = 0;
+    bl->blockcap = 0;
+    bl->context = context;
+    bl->atlas = atlas;
+    bl->font = NULL;
+    bl->header = pango_layout_new(context);
+    pango_layout_set_ellipsize(bl->header, PANGO_ELLIPSIZE_END);
+    bl->charwidth = 1;
+    bl->charheight = 1;
+    bl->width = -1;
+    bl->headerh = 0;
+    bl->height = 0;
+    sums_init(&bl->sums);
+    bl->top = 0;
+    bl->selected = -1;
+    bl->marked = -1;
+    bl->flood = false;
+    bl->changed = 0;
+}
+
+void blocks_free(Blocks *bl) {
+    Block *b;
+    int i;
+    for (i = 0; i < bl->nblocks; i++) {
+        b = bl->blocks[i];
+        if (!b->collapsed) {
+            view_free(&b->view);
+        }
+        free(b);
+    }
+    free(bl->blocks);
+    sums_free(&bl->sums);
+    if (bl->font != NULL) {
+        pango_font_description_free(bl->font);
+    }
+    g_object_unref(bl->header);
+    bl->blocks = NULL;
+    bl->nblocks = 0;
+    bl->blockcap = 0;
+    bl->font = NULL;
+    bl->header = NULL;
+}
+
+// Returns the height of the output part of a block.
+// A finished job doesn't get an empty line after its last newline.
+static long block_outheight(Block *b) {
+    if (b->collapsed) {
+        return 0;
+    }
+    if (b->job->running) {
+        return view_height(&b->view);
+    }
+    return view_trimheight(&b->view);
+}
+
+static void blocks_setheight(Blocks *bl, int i, long height) {
+    Block *b = bl->blocks[i];
+    bl->height += height - b->height;
+    sums_add(&bl->sums, i, height - b->height);
+    b->height = height;
+}
+
+// Recomputes the height of block i from what its view knows.
+static void blocks_measure(Blocks *bl, int i) {
+    blocks_setheight(bl, i, bl->headerh + block_outheight(bl->blocks[i]));
+}
+
+// Returns the y position of block i.
+static long blocks_top(Blocks *bl, int i) {
+    return sums_prefix(&bl->sums, i);
+}
+
+static void blocks_markchanged(Blocks *bl, long y) {
+    if (bl->changed < 0 || y < bl->changed) {
+        bl->changed = y;
+    }
+}
+
+// Returns the y position from which the blocks have changed
+// since the last call, or -1 if they haven't.
+long blocks_changed(Blocks *bl) {
+    long y = bl->changed;
+    bl->changed = -1;
+    return y;
+}
+
+static void block_openview(Blocks *bl, Block *b) {
+    view_init(&b->view, &b->job->hist, bl->context);
+    view_setatlas(&b->view, bl->atlas);
+    if (bl->font != NULL) {
+        view_setfont(&b->view, bl->font, bl->charwidth, bl->charheight);
+    }
+    view_setwidth(&b->view, bl->width);
+    view_setflood(&b->view, bl->flood);
+    view_update(&b->view);
+}
+
+void blocks_add(Blocks *bl, Job *job) {
+    Block *b;
+    if (bl->nblocks == bl->blockcap) {
+        void *v;
+        int newcap;
+        newcap = bl->blockcap * 2;
+        if (newcap == 0) {
+            newcap = 16;
+        }
+        if (newcap < bl->blockcap) {
+            printf("blocks: overflow\n");
+            exit(1);
+        }
+        v = realloc(bl->blocks, newcap * sizeof bl->blocks[0]);
+        if (v == NULL) {
+            perror("blocks: realloc");
+            exit(1);
+        }
+        bl->blocks = v;
+        bl->blockcap = newcap;
+    }
+    b = malloc(sizeof *b);
+    if (b == NULL) {
+        perror("blocks: malloc");
+        exit(1);
+    }
+    b->job = job;
+    b->height = 0;
+    b->collapsed = false;
+    b->wasrunning = job->running;
+    block_openview(bl, b);
+    blocks_markchanged(bl, bl->height);
+    bl->blocks[bl->nblocks] = b;
+    bl->nblocks++;
+    sums_push(&bl->sums, 0);
+    blocks_measure(bl, bl->nblocks-1);
+}
+
+// Recomputes every height, after the font or width changed.
+static void blocks_reset(Blocks *bl) {
+    int i;
+    bl->height = 0;
+    bl->changed = 0;
+    sums_clear(&bl->sums);
+    for (i = 0; i < bl->nblocks; i++) {
+        bl->blocks[i]->height = bl->headerh + block_outheight(bl->blocks[i]);
+        bl->height += bl->blocks[i]->height;
+        sums_push(&bl->sums, bl->blocks[i]->height);
+    }
+}
+
+void blocks_setfont(Blocks *bl, const PangoFontDescription *font, double charwidth, double charheight) {
+    int i;
+    if (bl->font != NULL) {
+        pango_font_description_free(bl->font);
+    }
+    bl->font = pango_font_description_copy(font);
+    bl->charwidth = charwidth;
+    bl->charheight = charheight;
+
+    pango_layout_set_font_description(bl->header, font);
+    pango_layout_set_text(bl->header, prompt, -1);
+    pango_layout_get_pixel_size(bl->header, NULL, &bl->headerh);
+
+    for (i = 0; i < bl->nblocks; i++) {
+        if (!bl->blocks[i]->collapsed) {
+            view_setfont(&bl->blocks[i]->view, font, charwidth, charheight);
+        }
+    }
+    blocks_reset(bl);
+}
+
+void blocks_setwidth(Blocks *bl, int width) {
+    int i;
+    if (width == bl->width) {
+        return;
+    }
+    bl->width = width;
+    pango_layout_set_width(bl->header, width);
+    for (i = 0; i < bl->nblocks; i++) {
+        if (!bl->blocks[i]->collapsed) {
+            view_setwidth(&bl->blocks[i]->view, width);
+        }
+    }
+    blocks_reset(bl);
+}
+
+// Turns flood mode on or off for every view. See view_setflood.
+void blocks_setflood(Blocks *bl, bool flood) {
+    int i;
+    bl->flood = flood;
+    for (i = 0; i < bl->nblocks; i++) {
+        if (!bl->blocks[i]->collapsed) {
+            view_setflood(&bl->blocks[i]->view, flood);
+        }
+    }
+}
+
+// Collapses a block down to its header, or expands it again.
+// A collapsed block forgets the layout of its output.
+void blocks_collapse(Blocks *bl, int i, bool collapsed) {
+    Block *b;
+    if (i < 0 || i >= bl->nblocks) {
+        return;
+    }
+    b = bl->blocks[i];
+    if (b->collapsed == collapsed) {
+        return;
+    }
+    if (collapsed) {
+        view_free(&b->view);
+    } else {
+        block_openview(bl, b);
+    }
+    b->collapsed = collapsed;
+    blocks_measure(bl, i);
+    blocks_markchanged(bl, blocks_top(bl, i));
+}
+
+// Collapses every job that has finished.
+void blocks_collapsedone(Blocks *bl) {
+    int i;
+    for (i = 0; i < bl->nblocks; i++) {
+        if (!bl->blocks[i]->job->running) {
+            blocks_collapse(bl, i, true);
+        }
+    }
+}
+
+// Catches up with output added to the jobs.
+// Returns the number of pixels that were dropped
+// off the top of blocks above the first one drawn.
+long blocks_update(Blocks *bl) {
+    Block *b;
+    long dropped, d, y;
+    int i;
+    dropped = 0;
+    for (i = 0; i < bl->nblocks; i++) {
+        b = bl->blocks[i];
+        if (b->wasrunning != b->job->running) {
+            // the header shows the exit status
+            b->wasrunning = b->job->running;
+            blocks_markchanged(bl, blocks_top(bl, i));
+        }
+        if (b->collapsed) {
+            blocks_measure(bl, i);
+            continue;
+        }
+        d = view_update(&b->view);
+        if (i <= bl->top) {
+            dropped += d;
+        }
+        y = view_changed(&b->view);
+        if (y >= 0) {
+            blocks_markchanged(bl, blocks_top(bl, i) + bl->headerh + y);
+        }
+        blocks_measure(bl, i);
+    }
+    return dropped;
+}
+
+// Returns the height of all the blocks, not counting the prompt.
+long blocks_height(Blocks *bl) {
+    return bl->height;
+}
+
+// Moves top to the block containing y.
+static void blocks_seek(Blocks *bl, long y) {
+    bl->top = sums_find(&bl->sums, y);
+    if (bl->top > bl->nblocks - 1) {
+        bl->top = bl->nblocks - 1;
+    }
+}
+
+// Returns the block at y, relative to the top of the first block,
+// and whether y is on its header. Returns -1 if there's no block there.
+int blocks_find(Blocks *bl, long y, bool *header) {
+    *header = false;
+    if (bl->nblocks == 0 || y < 0 || y >= bl->height) {
+        return -1;
+    }
+    blocks_seek(bl, y);
+    *header = y - blocks_top(bl, bl->top) < bl->headerh;
+    return bl->top;
+}
+
+static Block* blocks_selblock(Blocks *bl) {
+    if (bl->selected < 0) {
+        return NULL;
+    }
+    return bl->blocks[bl->selected];
+}
+
+// Picks the block that gets input, or -1 for the prompt.
+void blocks_select(Blocks *bl, int i) {
+    if (i < -1 || i >= bl->nblocks) {
+        i = -1;
+    }
+    if (i == bl->selected) {
+        return;
+    }
+    // the old and new headers and the prompt change
+    blocks_markchanged(bl, blocks_top(bl, bl->selected < 0 ? bl->nblocks : bl->selected));
+    blocks_markchanged(bl, blocks_top(bl, i < 0 ? bl->nblocks : i));
+    bl->selected = i;
+}
+
+// Moves the selection to the next running job,
+// or to the prompt after the last one.
+void blocks_selectnext(Blocks *bl) {
+    int i;
+    for (i = bl->selected + 1; i < bl->nblocks; i++) {
+        if (bl->blocks[i]->job->running) {
+            break;
+        }
+    }
+    blocks_select(bl, i);
+}
+
+// Highlights len bytes from off in block i's output,
+// and takes the highlight off any other block.
+// i is -1 to highlight nothing.
+void blocks_setmark(Blocks *bl, int i, size_t off, size_t len) {
+    Block *b;
+    if (bl->marked >= 0 && bl->marked != i) {
+        b = bl->blocks[bl->marked];
+        if (!b->collapsed) {
+            view_setmark(&b->view, 0, 0);
+        }
+    }
+    bl->marked = -1;
+    if (i < 0 || i >= bl->nblocks) {
+        return;
+    }
+    b = bl->blocks[i];
+    if (!b->collapsed) {
+        view_setmark(&b->view, off, len);
+        bl->marked = i;
+    }
+}
+
+// Returns the y position of a line of block i's output,
+// relative to the top of the first block.
+// The block is expanded if it was collapsed, and the lines
+// that fit in above pixels over the line are laid out,
+// so that putting the line there on screen is exact.
+long blocks_liney(Blocks *bl, int i, long line, int above) {
+    Block *b;
+    long y;
+    if (i < 0 || i >= bl->nblocks) {
+        return bl->height;
+    }
+    b = bl->blocks[i];
+    if (b->collapsed) {
+        blocks_collapse(bl, i, false);
+    }
+    y = view_liney(&b->view, line, above);
+    blocks_measure(bl, i);
+    return blocks_top(bl, i) + bl->headerh + y;
+}
+
+// Returns the job that gets input, or NULL if it's the prompt.
+Job* blocks_selected(Blocks *bl) {
+    Block *b = blocks_selblock(bl);
+    if (b == NULL) {
+        return NULL;
+    }
+    return b->job;
+}
+
+static int fmtsecs(char *buf, size_t size, double secs) {
+    if (secs < 1) {
+        return snprintf(buf, size, "%.0fms", secs * 1e3);
+    }
+    return snprintf(buf, size, "%.2fs", secs);
+}
+
+// Appends what a finished job used, so slow or memory-hungry
+// commands stand out: wall time, cpu time and peak rss.
+static void blocks_usage(char *buf, size_t size, Job *job) {
+    const struct rusage *ru = &job->rusage;
+    double cpu;
+    size_t n;
+
+    cpu = ru->ru_utime.tv_sec + ru->ru_stime.tv_sec +
+        (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1e6;
+    n = strlen(buf);
+    n += snprintf(buf+n, n < size ? size - n : 0, "  (");
+    n += fmtsecs(buf+n, n < size ? size - n : 0, job->wall);
+    n += snprintf(buf+n, n < size ? size - n : 0, ", cpu ");
+    n += fmtsecs(buf+n, n < size ? size - n : 0, cpu);
+    if (ru->ru_maxrss >= 1024*1024) {
+        snprintf(buf+n, n < size ? size - n : 0, ", %.1fG)", ru->ru_maxrss / (1024.0*1024));
+    } else if (ru->ru_maxrss >= 1024) {
+        snprintf(buf+n, n < size ? size - n : 0, ", %.1fM)", ru->ru_maxrss / 1024.0);
+    } else {
+        snprintf(buf+n, n < size ? size - n : 0, ", %ldK)", ru->ru_maxrss);
+    }
+}
+
+// Writes the text of a block's header into buf.
+static void blocks_header(Blocks *bl, Block *b, char *buf, size_t size) {
+    Job *job = b->job;
+    int n;
+    n = snprintf(buf, size, "%s%s", b == blocks_selblock(bl) ? selprompt : prompt, job->cmdline);
+    if (!job->running && n >= 0 && (size_t)n < size) {
+        if (WIFSIGNALED(job->status)) {
+            snprintf(buf+n, size - n, " [signal %d]", WTERMSIG(job->status));
+        } else if (WEXITSTATUS(job->status) != 0) {
+            snprintf(buf+n, size - n, " [%d]", WEXITSTATUS(job->status));
+        }
+        blocks_usage(buf, size, job);
+    }
+}
+
+// Copies the blocks that fall between 0 and height on the screen
+// into the scene, with the top of the first block at y.
+// Blocks outside the damage are left out.
+// Blocks above the screen are skipped by their cached height
+// without looking at any of their lines.
+// Notes which items are above the input in s->above.
+// Returns true if looking at lines moved any (see view_snap).
+bool blocks_snap(Blocks *bl, Scene *s, long y, int height) {
+    cairo_rectangle_int_t ext;
+    char buf[1024];
+    Block *b;
+    bool moved = false;
+    long by;
+    int i, k, first;
+
+    cairo_region_get_extents(s->damage, &ext);
+    if (ext.y + ext.height < height) {
+        height = ext.y + ext.height;
+    }
+    if (ext.y < 0) {
+        ext.y = 0;
+    }
+    s->above = -1;
+    first = s->nitems;
+    if (bl->nblocks > 0) {
+        blocks_seek(bl, ext.y - y);
+        by = blocks_top(bl, bl->top);
+        for (i = bl->top; i < bl->nblocks && y + by < height; i++) {
+            b = bl->blocks[i];
+            blocks_header(bl, b, buf, sizeof buf);
+            scene_add(s, SceneHeader, buf, strlen(buf), y + by, bl->headerh);
+            if (!b->collapsed) {
+                k = s->nitems;
+                if (view_snap(&b->view, s, y + by + bl->headerh, height)) {
+                    moved = true;
+                }
+                for (; k < s->nitems; k++) {
+                    s->items[k].block = i;
+                }
+                // copying may have replaced estimates with real heights
+                blocks_measure(bl, i);
+            }
+            if (i == bl->selected) {
+                s->above = s->nitems;
+            }
+            by += b->height;
+        }
+    }
+    if (bl->selected < 0 && y + bl->height < height) {
+        scene_add(s, SceneHeader, prompt, strlen(prompt), y + bl->height, bl->headerh);
+    }
+    if (s->above < 0) {
+        // the input is after everything, or above everything drawn
+        s->above = bl->selected >= 0 && bl->selected < bl->top ? first : s->nitems;
+    }
+    return moved;
+}
+
+// Takes the heights a frame found for lines that were only guessed.
+// Returns true if anything moved.
+bool blocks_measured(Blocks *bl, Scene *s) {
+    SceneItem *it;
+    Block *b;
+    bool moved = false;
+    int k;
+    for (k = 0; k < s->nitems; k++) {
+        it = &s->items[k];
+        if (!it->guessed || it->block < 0 || it->block >= bl->nblocks) {
+            continue;
+        }
+        b = bl->blocks[it->block];
+        if (b->collapsed) {
+            continue;
+        }
+        if (view_measured(&b->view, it->gen, it->line, it->len, it->height)) {
+            moved = true;
+        }
+        blocks_measure(bl, it->block);
+    }
+    return moved;
+}
+
+// Finds where input goes, relative to the top of the first block:
+// after the prompt, or at the end of the selected job's output.
+void blocks_endpos(Blocks *bl, int *x, int *y) {
+    PangoRectangle rect;
+    Block *b;
+    long top;
+
+    if (bl->selected < 0) {
+        pango_layout_set_text(bl->header, prompt, -1);
+        pango_layout_index_to_pos(bl->header, strlen(prompt), &rect);
+        pango_extents_to_pixels(NULL, &rect);
+        *x = rect.x;
+        *y = bl->height;
+        return;
+    }
+    b = bl->blocks[bl->selected];
+    top = blocks_top(bl, bl->selected);
+    if (b->collapsed) {
+        *x = 0;
+        *y = top + bl->headerh;
+        return;
+    }
+    view_endpos(&b->view, x, y);
+    *y += top + bl->headerh;
+}
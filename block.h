@@ -0,0 +1,70 @@
+//#include <stdbool.h> /* bool */
+//#include <pango/pangocairo.h>
+//#include "hist.h"
+//#include "shell.h"
+//#include "atlas.h"
+//#include "sums.h"
+//#include "render.h"
+//#include "view.h"
+
+// Blocks:
+//   lays out the jobs one after another,
+//   each as a header line followed by its output
+//   keeps the height of every block,
+//   so that scrolling can skip whole jobs
+
+typedef struct Blocks Blocks;
+typedef struct Block Block;
+
+struct Block {
+    Job *job;
+    View view; // only valid if not collapsed
+    long height; // header plus output, in pixels
+    bool collapsed; // only the header is shown
+    bool wasrunning; // running when we last looked
+};
+
+struct Blocks {
+    Block **blocks;
+    int nblocks;
+    int blockcap;
+
+    PangoContext *context;
+    Atlas *atlas; // shared with the views
+    PangoFontDescription *font;
+    PangoLayout *header; // shared by all the headers
+    double charwidth;
+    double charheight;
+    int width; // wrap width in pango units
+    int headerh; // height of a header in pixels
+    long height; // total height in pixels
+
+    Sums sums; // running totals of the block heights
+    int top; // the first block we drew last time
+
+    int selected; // block that gets input, -1 for the prompt
+    int marked; // block with a highlight in it, or -1
+    bool flood; // output is coming in faster than it can be looked at
+    long changed; // y of the first pixel that changed, -1 if none
+};
+
+void blocks_init(Blocks *bl, PangoContext *context, Atlas *atlas);
+void blocks_free(Blocks *bl);
+void blocks_add(Blocks *bl, Job *job);
+void blocks_setfont(Blocks *bl, const PangoFontDescription *font, double charwidth, double charheight);
+void blocks_setwidth(Blocks *bl, int width);
+void blocks_setflood(Blocks *bl, bool flood);
+void blocks_collapse(Blocks *bl, int i, bool collapsed);
+void blocks_collapsedone(Blocks *bl);
+void blocks_select(Blocks *bl, int i);
+void blocks_selectnext(Blocks *bl);
+Job* blocks_selected(Blocks *bl);
+void blocks_setmark(Blocks *bl, int i, size_t off, size_t len);
+long blocks_liney(Blocks *bl, int i, long line, int above);
+long blocks_update(Blocks *bl);
+long blocks_changed(Blocks *bl);
+long blocks_height(Blocks *bl);
+int blocks_find(Blocks *bl, long y, bool *header);
+bool blocks_snap(Blocks *bl, Scene *s, long y, int height);
+bool blocks_measured(Blocks *bl, Scene *s);
+void blocks_endpos(Blocks *bl, int *x, int *y);
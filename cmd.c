@@ -0,0 +1,447 @@
+#define _GNU_SOURCE // pipe2
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "cmd.h"
+
+// Words that mean something to the shell itself.
+// A command starting with one of these goes to /bin/sh.
+static const char *shellwords[] = {
+    "!", ".", ":", "[[", "alias", "bg", "break", "case", "cd", "command",
+    "continue", "do", "done", "elif", "else", "esac", "eval", "exec", "exit",
+    "export", "fc", "fg", "fi", "for", "function", "getopts", "hash", "if",
+    "jobs", "local", "read", "readonly", "return", "select", "set", "shift",
+    "source", "then", "time", "times", "trap", "type", "ulimit", "umask",
+    "unalias", "unset", "until", "wait", "while", "{", "}",
+};
+
+static bool isblank_(char c) {
+    return c == ' ' || c == '\t';
+}
+
+// Characters that end a word.
+static bool ismeta(char c) {
+    return c == '\0' || isblank_(c) || strchr("|&;<>()\n", c) != NULL;
+}
+
+// Characters that make the shell do something we don't,
+// if they aren't quoted.
+static bool isexpand(char c) {
+    return strchr("$`*?[{}", c) != NULL;
+}
+
+// Reads a word starting at *s into *out.
+// Returns false if it needs the shell.
+static bool cmd_word(const char **s, char **out) {
+    const char *p = *s;
+    char *q = *out;
+
+    if (*p == '#' || *p == '~' || *p == '!') {
+        // comment, home directory, history or negation
+        return false;
+    }
+    while (!ismeta(*p)) {
+        if (*p == '\\') {
+            p++;
+            if (*p == '\0' || *p == '\n') {
+                return false;
+            }
+            *q++ = *p++;
+        } else if (*p == '\'') {
+            p++;
+            while (*p != '\'') {
+                if (*p == '\0') {
+                    return false;
+                }
+                *q++ = *p++;
+            }
+            p++;
+        } else if (*p == '"') {
+            p++;
+            while (*p != '"') {
+                if (*p == '\0' || *p == '$' || *p == '`') {
+                    return false;
+                }
+                if (*p == '\\' && p[1] != '\0' && strchr("\"\\$`", p[1]) != NULL) {
+                    p++;
+                } else if (*p == '\\' && (p[1] == '\0' || p[1] == '\n')) {
+                    return false;
+                }
+                *q++ = *p++;
+            }
+            p++;
+        } else if (isexpand(*p)) {
+            return false;
+        } else {
+            *q++ = *p++;
+        }
+    }
+    *q++ = '\0';
+    *s = p;
+    *out = q;
+    return true;
+}
+
+static void skipblanks(const char **s) {
+    while (isblank_(**s)) {
+        (*s)++;
+    }
+}
+
+// Reads the file name after a redirection.
+static bool cmd_target(const char **s, char **out, char **file) {
+    skipblanks(s);
+    if (ismeta(**s)) {
+        return false;
+    }
+    *file = *out;
+    return cmd_word(s, out);
+}
+
+static bool cmd_isshellword(const char *w) {
+    size_t i;
+    for (i = 0; i < sizeof shellwords / sizeof shellwords[0]; i++) {
+        if (strcmp(w, shellwords[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses a command line.
+// Returns 0 if it's simple enough to run without the shell,
+// or -1 if it should be left to /bin/sh. Call cmd_free either way.
+int cmd_parse(Cmd *c, const char *line) {
+    const char *s = line;
+    CmdProc *p;
+    char *out;
+    int i;
+
+    c->nprocs = 0;
+    c->buf = malloc(strlen(line) + 1);
+    if (c->buf == NULL) {
+        perror("cmd_parse: malloc");
+        return -1;
+    }
+    out = c->buf;
+    p = &c->procs[0];
+    memset(p, 0, sizeof *p);
+    c->nprocs = 1;
+
+    for (;;) {
+        skipblanks(&s);
+        if (*s == '\0') {
+            break;
+        }
+        if (*s == '|') {
+            if (s[1] == '|' || p->argc == 0 || c->nprocs == CmdMaxProcs) {
+                return -1;
+            }
+            s++;
+            p = &c->procs[c->nprocs++];
+            memset(p, 0, sizeof *p);
+            continue;
+        }
+        if (*s == '<') {
+            if (s[1] == '<' || s[1] == '>' || s[1] == '&') {
+                return -1;
+            }
+            s++;
+            if (!cmd_target(&s, &out, &p->in)) {
+                return -1;
+            }
+            continue;
+        }
+        if (*s == '>' || (*s == '2' && s[1] == '>')) {
+            bool err = *s == '2';
+            bool append;
+            char **file;
+            s += err ? 2 : 1;
+            if (err && s[0] == '&' && s[1] == '1' && ismeta(s[2])) {
+                if (p->err != NULL) {
+                    return -1;
+                }
+                p->errout = true;
+                s += 2;
+                continue;
+            }
+            if (*s == '&' || *s == '|') {
+                return -1;
+            }
+            append = *s == '>';
+            if (append) {
+                s++;
+            }
+            if (err) {
+                if (p->errout || p->err != NULL) {
+                    return -1;
+                }
+                file = &p->err;
+                p->errappend = append;
+            } else {
+                if (p->errout) {
+                    // 2>&1 >file means something else
+                    return -1;
+                }
+                file = &p->out;
+                p->outappend = append;
+            }
+            if (!cmd_target(&s, &out, file)) {
+                return -1;
+            }
+            continue;
+        }
+        if (ismeta(*s)) {
+            // ; & ( ) and newlines
+            return -1;
+        }
+        if (*s >= '0' && *s <= '9') {
+            // some other descriptor being redirected?
+            for (i = 0; s[i] >= '0' && s[i] <= '9'; i++) {
+            }
+            if (s[i] == '<' || s[i] == '>') {
+                return -1;
+            }
+        }
+        if (p->argc == CmdMaxArgs) {
+            return -1;
+        }
+        if (p->argc == 0 && strcspn(s, "=\"'\\ \t|<>") < strcspn(s, "\"'\\ \t|<>")) {
+            // a variable assignment
+            return -1;
+        }
+        p->argv[p->argc] = out;
+        if (!cmd_word(&s, &out)) {
+            return -1;
+        }
+        p->argc++;
+    }
+
+    for (i = 0; i < c->nprocs; i++) {
+        p = &c->procs[i];
+        if (p->argc == 0 || cmd_isshellword(p->argv[0])) {
+            return -1;
+        }
+        p->argv[p->argc] = NULL;
+    }
+    return 0;
+}
+
+void cmd_free(Cmd *c) {
+    int i;
+    for (i = 0; i < c->nprocs; i++) {
+        free(c->procs[i].path);
+    }
+    free(c->buf);
+    c->buf = NULL;
+    c->nprocs = 0;
+}
+
+// Prints "what: error" for errno straight to stderr.
+// Used in the vfork child, which mustn't touch stdio:
+// its buffers and locks are ours.
+void cmd_error(const char *what) {
+    const char *msg = strerror(errno);
+    struct iovec iov[4];
+    iov[0].iov_base = (char*)what;
+    iov[0].iov_len = strlen(what);
+    iov[1].iov_base = ": ";
+    iov[1].iov_len = 2;
+    iov[2].iov_base = (char*)msg;
+    iov[2].iov_len = strlen(msg);
+    iov[3].iov_base = "\n";
+    iov[3].iov_len = 1;
+    writev(2, iov, 4);
+}
+
+static void cmd_redirect(int fd, const char *file, int flags) {
+    int f = open(file, flags, 0666);
+    if (f < 0) {
+        cmd_error(file);
+        _exit(1);
+    }
+    if (f != fd) {
+        dup2(f, fd);
+        close(f);
+    }
+}
+
+// Fills in the arguments for running a script without #!
+// the way the shell would: sh followed by its path and arguments.
+static void cmd_shargv(CmdProc *p, char **argv) {
+    int i;
+    argv[0] = "sh";
+    argv[1] = p->path;
+    for (i = 1; i <= p->argc; i++) {
+        argv[i+1] = p->argv[i];
+    }
+}
+
+// Execs one command. Doesn't return.
+static void cmd_run(CmdProc *p, char **envp) {
+    char *argv[CmdMaxArgs+2];
+
+    if (p->in != NULL) {
+        cmd_redirect(0, p->in, O_RDONLY);
+    }
+    if (p->out != NULL) {
+        cmd_redirect(1, p->out, O_WRONLY | O_CREAT | (p->outappend ? O_APPEND : O_TRUNC));
+    }
+    if (p->err != NULL) {
+        cmd_redirect(2, p->err, O_WRONLY | O_CREAT | (p->errappend ? O_APPEND : O_TRUNC));
+    }
+    if (p->errout) {
+        dup2(1, 2);
+    }
+    execve(p->path, p->argv, envp);
+    if (errno == ENOEXEC) {
+        cmd_shargv(p, argv);
+        execve("/bin/sh", argv, envp);
+    }
+    cmd_error(p->argv[0]);
+    _exit(errno == ENOENT ? 127 : 126);
+}
+
+// Opens a redirection's file for cmd_spawn and has the command get it
+// as fd. It's close-on-exec, so the command sees only the copy.
+static bool cmd_addfile(posix_spawn_file_actions_t *fa, int fd, const char *file, int flags, int *files, int *nfiles) {
+    int f = open(file, flags | O_CLOEXEC, 0666);
+    if (f < 0) {
+        perror(file);
+        return false;
+    }
+    files[(*nfiles)++] = f;
+    posix_spawn_file_actions_adddup2(fa, f, fd);
+    return true;
+}
+
+// Starts one command of a pipeline, reading from in and writing
+// to out unless they're -1. posix_spawn does the fork and exec
+// without copying our page tables, and only the dup2s happen in
+// the child, so there's nothing in it to go wrong with shared memory.
+// Returns its pid, or -1 with *code set to what it would have exited with.
+static pid_t cmd_spawn(CmdProc *p, int in, int out, char **envp, int *code) {
+    posix_spawn_file_actions_t fa;
+    char *argv[CmdMaxArgs+2];
+    int files[3], nfiles, err, i;
+    bool ok;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&fa);
+    if (in >= 0) {
+        posix_spawn_file_actions_adddup2(&fa, in, 0);
+    }
+    if (out >= 0) {
+        posix_spawn_file_actions_adddup2(&fa, out, 1);
+    }
+    nfiles = 0;
+    ok = true;
+    if (ok && p->in != NULL) {
+        ok = cmd_addfile(&fa, 0, p->in, O_RDONLY, files, &nfiles);
+    }
+    if (ok && p->out != NULL) {
+        ok = cmd_addfile(&fa, 1, p->out, O_WRONLY | O_CREAT | (p->outappend ? O_APPEND : O_TRUNC), files, &nfiles);
+    }
+    if (ok && p->err != NULL) {
+        ok = cmd_addfile(&fa, 2, p->err, O_WRONLY | O_CREAT | (p->errappend ? O_APPEND : O_TRUNC), files, &nfiles);
+    }
+    if (p->errout) {
+        posix_spawn_file_actions_adddup2(&fa, 1, 2);
+    }
+
+    pid = -1;
+    *code = 1;
+    if (ok) {
+        err = posix_spawn(&pid, p->path, &fa, NULL, p->argv, envp);
+        if (err == ENOEXEC) {
+            cmd_shargv(p, argv);
+            err = posix_spawn(&pid, "/bin/sh", &fa, NULL, argv, envp);
+        }
+        if (err != 0) {
+            errno = err;
+            perror(p->argv[0]);
+            pid = -1;
+            *code = err == ENOENT ? 127 : 126;
+        }
+    }
+    for (i = 0; i < nfiles; i++) {
+        close(files[i]);
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    return pid;
+}
+
+// Runs every command of a pipeline as a child of this process,
+// waits for all of them and exits the way the last one did.
+// The job is this process, so it isn't over until every
+// command is, and none of them end up as children of another.
+// It's what jobpipe runs; it isn't safe in a vfork child.
+void cmd_pipeline(Cmd *c, char **envp) {
+    pid_t pids[CmdMaxProcs], pid;
+    int fds[2], in, n, status, last, code;
+
+    in = -1;
+    code = 0;
+    for (n = 0; n < c->nprocs; n++) {
+        fds[0] = fds[1] = -1;
+        if (n < c->nprocs - 1 && pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            break;
+        }
+        pids[n] = cmd_spawn(&c->procs[n], in, fds[1], envp, &code);
+        if (in >= 0) {
+            close(in);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        in = fds[0];
+    }
+    if (in >= 0) {
+        close(in);
+    }
+
+    // ^C is for the commands; we go once they have
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    last = 0;
+    for (;;) {
+        pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (n == c->nprocs && pid == pids[n-1]) {
+            last = status;
+        }
+    }
+    if (n < c->nprocs) {
+        _exit(126);
+    }
+    if (pids[n-1] < 0) {
+        _exit(code);
+    }
+    if (WIFSIGNALED(last)) {
+        signal(WTERMSIG(last), SIG_DFL);
+        raise(WTERMSIG(last));
+        _exit(128 + WTERMSIG(last));
+    }
+    _exit(WEXITSTATUS(last));
+}
+
+// Runs a parsed single command in this process. Doesn't return.
+// Its path must be filled in. Safe in a vfork child;
+// pipelines go to jobpipe instead, see cmd_pipeline.
+void cmd_exec(Cmd *c, char **envp) {
+    cmd_run(&c->procs[0], envp);
+}
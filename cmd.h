@@ -0,0 +1,38 @@
+//#include <stdbool.h> /* bool */
+
+// Cmd:
+//   parses simple command lines, so they can be run without /bin/sh:
+//   words, quotes, backslashes, pipes and < > >> 2> 2>> 2>&1
+//   anything else (variables, globs, lists, builtins...) is left to the shell
+
+enum {
+    CmdMaxProcs = 8, // commands in a pipeline
+    CmdMaxArgs = 64, // words in a command
+};
+
+typedef struct Cmd Cmd;
+typedef struct CmdProc CmdProc;
+
+struct CmdProc {
+    char *argv[CmdMaxArgs+1]; // ends in NULL
+    int argc;
+    char *path; // where argv[0] is, filled in by the caller
+    char *in; // file for stdin, or NULL
+    char *out; // file for stdout, or NULL
+    bool outappend;
+    char *err; // file for stderr, or NULL
+    bool errappend;
+    bool errout; // 2>&1
+};
+
+struct Cmd {
+    CmdProc procs[CmdMaxProcs];
+    int nprocs;
+    char *buf; // the words, unquoted
+};
+
+int cmd_parse(Cmd *c, const char *line);
+void cmd_free(Cmd *c);
+void cmd_exec(Cmd *c, char **envp);
+void cmd_pipeline(Cmd *c, char **envp);
+void cmd_error(const char *what);
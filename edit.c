@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "edit.h"
+
+void edit_init(Edit *e) {
+    e->buf = NULL;
+    e->cap = 0;
+    e->gap = 0;
+    e->gapend = 0;
+}
+
+void edit_free(Edit *e) {
+    free(e->buf);
+    edit_init(e);
+}
+
+size_t edit_len(Edit *e) {
+    return e->cap - (e->gapend - e->gap);
+}
+
+// Moves the gap so that it starts at pos.
+static void edit_move(Edit *e, size_t pos) {
+    size_t n;
+    if (pos < e->gap) {
+        n = e->gap - pos;
+        memmove(e->buf + e->gapend - n, e->buf + pos, n);
+        e->gap -= n;
+        e->gapend -= n;
+    } else if (pos > e->gap) {
+        n = pos - e->gap;
+        memmove(e->buf + e->gap, e->buf + e->gapend, n);
+        e->gap += n;
+        e->gapend += n;
+    }
+}
+
+// Makes the gap at least len bytes, plus one for edit_text's NUL.
+static void edit_reserve(Edit *e, size_t len) {
+    size_t newcap, after;
+    char *v;
+
+    if (e->gapend - e->gap > len) {
+        return;
+    }
+    newcap = e->cap * 2;
+    if (newcap < 256) {
+        newcap = 256;
+    }
+    if (newcap < edit_len(e) + len + 1) {
+        newcap = edit_len(e) + len + 1;
+    }
+    v = realloc(e->buf, newcap);
+    if (v == NULL) {
+        perror("edit_reserve: realloc");
+        exit(1);
+    }
+    after = e->cap - e->gapend;
+    memmove(v + newcap - after, v + e->gapend, after);
+    e->buf = v;
+    e->gapend = newcap - after;
+    e->cap = newcap;
+}
+
+void edit_insert(Edit *e, size_t pos, const char *s, size_t len) {
+    if (pos > edit_len(e)) {
+        pos = edit_len(e);
+    }
+    edit_reserve(e, len);
+    edit_move(e, pos);
+    memcpy(e->buf + e->gap, s, len);
+    e->gap += len;
+}
+
+// Removes len bytes starting at pos.
+void edit_delete(Edit *e, size_t pos, size_t len) {
+    if (pos > edit_len(e)) {
+        return;
+    }
+    if (len > edit_len(e) - pos) {
+        len = edit_len(e) - pos;
+    }
+    edit_move(e, pos);
+    e->gapend += len;
+}
+
+void edit_clear(Edit *e) {
+    e->gap = 0;
+    e->gapend = e->cap;
+}
+
+// Returns the start of the text, with its first pos bytes contiguous.
+char* edit_before(Edit *e, size_t pos) {
+    if (pos > edit_len(e)) {
+        pos = edit_len(e);
+    }
+    edit_move(e, pos);
+    return e->buf;
+}
+
+// Returns the text from pos to the end, contiguous,
+// and its length in *len.
+char* edit_after(Edit *e, size_t pos, size_t *len) {
+    if (pos > edit_len(e)) {
+        pos = edit_len(e);
+    }
+    edit_move(e, pos);
+    *len = e->cap - e->gapend;
+    return e->buf + e->gapend;
+}
+
+// Returns the text as the two runs either side of the gap,
+// without moving it: the text is *a followed by *b.
+void edit_segments(Edit *e, char **a, size_t *alen, char **b, size_t *blen) {
+    *a = e->buf;
+    *alen = e->gap;
+    *b = e->buf + e->gapend;
+    *blen = e->cap - e->gapend;
+}
+
+// Returns the whole text as one NUL-terminated string,
+// by moving the gap to the end. Good until the next change.
+// This costs as much as the text after the gap, so it's only
+// for when the line is done; drawing uses edit_segments.
+char* edit_text(Edit *e) {
+    edit_reserve(e, 0);
+    edit_move(e, edit_len(e));
+    e->buf[e->gap] = '\0';
+    return e->buf;
+}
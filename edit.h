@@ -0,0 +1,26 @@
+//#include <stddef.h> /* size_t */
+
+// Edit:
+//   the input line, as a gap buffer
+//   the gap follows wherever text was last inserted or deleted,
+//   so typing and pasting cost only what's typed or pasted
+
+typedef struct Edit Edit;
+
+struct Edit {
+    char *buf;
+    size_t cap;
+    size_t gap; // start of the gap
+    size_t gapend; // end of the gap
+};
+
+void edit_init(Edit *e);
+void edit_free(Edit *e);
+size_t edit_len(Edit *e);
+void edit_insert(Edit *e, size_t pos, const char *s, size_t len);
+void edit_delete(Edit *e, size_t pos, size_t len);
+void edit_clear(Edit *e);
+char* edit_before(Edit *e, size_t pos);
+char* edit_after(Edit *e, size_t pos, size_t *len);
+void edit_segments(Edit *e, char **a, size_t *alen, char **b, size_t *blen);
+char* edit_text(Edit *e);
@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "find.h"
+
+// Candidates are positions where both the first and the last byte
+// of the pattern match; only those get a full compare.
+// Checking two bytes far apart rules out nearly every position
+// in ordinary text, even for common letters.
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define FIND_X86 1
+#include <immintrin.h>
+#endif
+
+static size_t findmem_scalar(const char *hay, size_t n, const char *pat, size_t m) {
+    const char *p, *end;
+    if (m > n) {
+        return n;
+    }
+    end = hay + n - m + 1;
+    for (p = hay; p < end; p++) {
+        p = memchr(p, pat[0], end - p);
+        if (p == NULL) {
+            break;
+        }
+        if (p[m-1] == pat[m-1] && memcmp(p, pat, m) == 0) {
+            return p - hay;
+        }
+    }
+    return n;
+}
+
+#ifdef FIND_X86
+static size_t findmem_sse2(const char *hay, size_t n, const char *pat, size_t m) {
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[m-1]);
+    __m128i a, b;
+    size_t i, k;
+    unsigned mask;
+    for (i = 0; i + m - 1 + 16 <= n; i += 16) {
+        a = _mm_loadu_si128((const __m128i*)(hay+i));
+        b = _mm_loadu_si128((const __m128i*)(hay+i+m-1));
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            k = i + __builtin_ctz(mask);
+            if (memcmp(hay+k+1, pat+1, m-1) == 0) {
+                return k;
+            }
+            mask &= mask - 1;
+        }
+    }
+    k = findmem_scalar(hay+i, n-i, pat, m);
+    return k == n-i ? n : i + k;
+}
+
+__attribute__((target("avx2")))
+static size_t findmem_avx2(const char *hay, size_t n, const char *pat, size_t m) {
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[m-1]);
+    __m256i a, b;
+    size_t i, k;
+    unsigned mask;
+    for (i = 0; i + m - 1 + 32 <= n; i += 32) {
+        a = _mm256_loadu_si256((const __m256i*)(hay+i));
+        b = _mm256_loadu_si256((const __m256i*)(hay+i+m-1));
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            k = i + __builtin_ctz(mask);
+            if (memcmp(hay+k+1, pat+1, m-1) == 0) {
+                return k;
+            }
+            mask &= mask - 1;
+        }
+    }
+    k = findmem_sse2(hay+i, n-i, pat, m);
+    return k == n-i ? n : i + k;
+}
+#endif
+
+static size_t findmem_init(const char *hay, size_t n, const char *pat, size_t m);
+static size_t (*findmem_impl)(const char *hay, size_t n, const char *pat, size_t m) = findmem_init;
+
+static size_t findmem_init(const char *hay, size_t n, const char *pat, size_t m) {
+    findmem_impl = findmem_scalar;
+#ifdef FIND_X86
+    findmem_impl = findmem_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        findmem_impl = findmem_avx2;
+    }
+#endif
+    return findmem_impl(hay, n, pat, m);
+}
+
+// Returns the offset of the first place pat occurs in hay,
+// or n if it doesn't.
+size_t findmem(const char *hay, size_t n, const char *pat, size_t m) {
+    if (m == 0) {
+        return 0;
+    }
+    if (m > n) {
+        return n;
+    }
+    if (m == 1) {
+        const char *p = memchr(hay, pat[0], n);
+        return p == NULL ? n : (size_t)(p - hay);
+    }
+    return findmem_impl(hay, n, pat, m);
+}
+
+// Returns the offset of the last place pat occurs in hay,
+// or n if it doesn't.
+size_t findmemlast(const char *hay, size_t n, const char *pat, size_t m) {
+    size_t i, k, found;
+    found = n;
+    for (i = 0; i < n; i = k + 1) {
+        k = i + findmem(hay+i, n-i, pat, m);
+        if (k >= n) {
+            break;
+        }
+        found = k;
+    }
+    return found;
+}
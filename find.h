@@ -0,0 +1,9 @@
+//#include <stddef.h> /* size_t */
+
+// Find:
+//   substring search over plain bytes, for searching scrollback
+//   compares 16 or 32 starting positions at a time;
+//   the vector width is picked at runtime
+
+size_t findmem(const char *hay, size_t n, const char *pat, size_t m);
+size_t findmemlast(const char *hay, size_t n, const char *pat, size_t m);
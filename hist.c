@@ -0,0 +1,965 @@
+#define _GNU_SOURCE // fallocate
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#include "find.h"
+#include "hist.h"
+
+static void hist_spill(Hist *h);
+static void hist_cool(Hist *h);
+static int hist_findchunk(Hist *h, size_t off);
+
+// Histories with chunks loaded, most recently used first.
+// Only HistHot of them keep any; the rest are let go.
+static Hist *hot[HistHot];
+
+// Every history, oldest first, and the bytes of chunks they hold.
+static Hist *oldest;
+static Hist *newest;
+static size_t held;
+static size_t total; // 0 = unlimited
+
+// A chunk loaded only to look at its lines, see hist_peek.
+static Hist *peeked;
+static size_t peekedoff;
+
+void hist_init(Hist *h) {
+    h->chunks = NULL;
+    h->nchunks = 0;
+    h->chunkcap = 0;
+    h->start = 0;
+    h->len = 0;
+    h->limit = 0;
+    h->tri = 0;
+
+    h->resident = 0;
+    h->nspilled = 0;
+    h->nloaded = 0;
+    h->spillfd = -1;
+    h->spillend = 0;
+    h->clock = 0;
+
+    h->lastline = 0;
+    h->laststart = 0;
+
+    h->older = newest;
+    h->newer = NULL;
+    if (newest != NULL) {
+        newest->newer = h;
+    } else {
+        oldest = h;
+    }
+    newest = h;
+}
+
+// Lets go of a chunk's line index. The count stays.
+static void hist_droplines(HistChunk *c) {
+    free(c->lines);
+    c->lines = NULL;
+    c->linecap = 0;
+}
+
+// Lets go of a spilled or packed chunk's data.
+static void hist_unload(Hist *h, HistChunk *c) {
+    if (c->z != NULL) {
+        free(c->data);
+    } else {
+        munmap(c->data, HistChunkSize);
+    }
+    c->data = NULL;
+    hist_droplines(c);
+    h->nloaded--;
+}
+
+// Gives back the memory or disk space a chunk takes up.
+static void hist_freechunk(Hist *h, HistChunk *c) {
+    held -= HistChunkSize;
+    free(c->tri);
+    hist_droplines(c);
+    if (c->packing) {
+        // still being compressed; hist_pack frees it
+        return;
+    }
+    if (c->z != NULL) {
+        if (c->data != NULL) {
+            hist_unload(h, c);
+        }
+        free(c->z);
+        return;
+    }
+    if (c->spill < 0) {
+        free(c->data);
+        return;
+    }
+    if (c->data != NULL) {
+        hist_unload(h, c);
+    }
+    // Punch a hole so the file only takes up
+    // as much disk as the chunks still held.
+    fallocate(h->spillfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        c->spill, HistChunkSize);
+}
+
+void hist_free(Hist *h) {
+    int i;
+    for (i = 0; i < h->nchunks; i++) {
+        hist_freechunk(h, &h->chunks[i]);
+    }
+    free(h->chunks);
+    if (h->spillfd >= 0) {
+        close(h->spillfd);
+    }
+    for (i = 0; i < HistHot; i++) {
+        if (hot[i] == h) {
+            memmove(hot+i, hot+i+1, (HistHot-i-1) * sizeof hot[0]);
+            hot[HistHot-1] = NULL;
+            break;
+        }
+    }
+    if (peeked == h) {
+        peeked = NULL;
+    }
+    h->spillfd = -1;
+    h->nspilled = 0;
+    h->nloaded = 0;
+    h->chunks = NULL;
+    h->nchunks = 0;
+    h->chunkcap = 0;
+    h->start = h->len;
+
+    if (h->older != NULL) {
+        h->older->newer = h->newer;
+    } else if (oldest == h) {
+        oldest = h->newer;
+    }
+    if (h->newer != NULL) {
+        h->newer->older = h->older;
+    } else if (newest == h) {
+        newest = h->older;
+    }
+    h->older = NULL;
+    h->newer = NULL;
+}
+
+// Notes that a line starts at off in chunk c, after a newline.
+static void hist_addline(HistChunk *c, uint32_t off) {
+    if (c->nlines == c->linecap) {
+        void *v;
+        int newcap;
+        newcap = c->linecap * 2;
+        if (newcap == 0) {
+            newcap = 64;
+        }
+        v = realloc(c->lines, newcap * sizeof c->lines[0]);
+        if (v == NULL) {
+            perror("hist: realloc");
+            exit(1);
+        }
+        c->lines = v;
+        c->linecap = newcap;
+    }
+    c->lines[c->nlines] = off;
+    c->nlines++;
+}
+
+// Finds the lines of a chunk whose data was just loaded.
+// The count is already known, so the index is made that big.
+static void hist_findlines(HistChunk *c) {
+    char *p, *end;
+    int n;
+    c->lines = malloc((c->nlines > 0 ? c->nlines : 1) * sizeof c->lines[0]);
+    if (c->lines == NULL) {
+        perror("hist: malloc");
+        exit(1);
+    }
+    c->linecap = c->nlines;
+    n = 0;
+    end = c->data + c->len;
+    for (p = c->data; n < c->nlines && (p = memchr(p, '\n', end-p)) != NULL; p++) {
+        c->lines[n++] = p+1 - c->data;
+    }
+}
+
+// Drops the n oldest chunks. The newest is always kept.
+static void hist_drop(Hist *h, int n) {
+    int i;
+    if (n >= h->nchunks) {
+        n = h->nchunks - 1;
+    }
+    if (n <= 0) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        hist_freechunk(h, &h->chunks[i]);
+    }
+    memmove(h->chunks, h->chunks+n, (h->nchunks-n) * sizeof h->chunks[0]);
+    h->nchunks -= n;
+    h->nspilled -= n < h->nspilled ? n : h->nspilled;
+    // The lines that ended in the dropped chunks go with them.
+    // The oldest line may lose its beginning.
+    h->start = h->chunks[0].off;
+}
+
+// Drop the oldest chunks until we're under the limit.
+// The newest chunk is never dropped.
+static void hist_trim(Hist *h) {
+    int n;
+    if (h->limit == 0) {
+        return;
+    }
+    for (n = 0; n < h->nchunks - 1; n++) {
+        if ((size_t)(h->nchunks - n) * HistChunkSize <= h->limit) {
+            break;
+        }
+    }
+    hist_drop(h, n);
+}
+
+// Drop chunks from the oldest histories until all of them
+// together are under the total. Each keeps its newest chunk.
+static void hist_trimtotal(void) {
+    Hist *h;
+    size_t n;
+    for (h = oldest; h != NULL && total != 0 && held > total; h = h->newer) {
+        if (h->nchunks <= 1) {
+            // nothing it can spare
+            continue;
+        }
+        n = (held - total + HistChunkSize - 1) / HistChunkSize;
+        if (n > (size_t)h->nchunks - 1) {
+            n = h->nchunks - 1;
+        }
+        hist_drop(h, n);
+    }
+}
+
+// Sets how many bytes of chunks all histories together may hold,
+// on top of each one's own limit. Past it, the oldest histories
+// lose their oldest chunks first.
+void hist_settotal(size_t limit) {
+    total = limit;
+    hist_trimtotal();
+}
+
+void hist_setlimit(Hist *h, size_t limit) {
+    h->limit = limit;
+    hist_trim(h);
+}
+
+// Sets how many bytes of chunks to keep on the heap.
+// Older chunks are written to a file in $TMPDIR
+// and mapped back in when they're looked at.
+// The file is unlinked as soon as it's created.
+void hist_setresident(Hist *h, size_t resident) {
+    h->resident = resident;
+    hist_spill(h);
+}
+
+static int hist_openspill(Hist *h) {
+    char path[256];
+    const char *dir;
+    int fd;
+    dir = getenv("TMPDIR");
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+    snprintf(path, sizeof path, "%s/histXXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("hist: mkstemp");
+        return -1;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    h->spillfd = fd;
+    return 0;
+}
+
+// Writes the oldest chunks on the heap out to the spill file
+// until the rest fit under the resident limit.
+// The newest chunk is never spilled.
+// If the file can't be written, everything stays on the heap.
+static void hist_spill(Hist *h) {
+    HistChunk *c;
+    ssize_t n;
+    if (h->resident == 0) {
+        return;
+    }
+    while (h->nspilled < h->nchunks - 1 &&
+           (size_t)(h->nchunks - h->nspilled) * HistChunkSize > h->resident) {
+        if (h->spillfd < 0 && hist_openspill(h) < 0) {
+            h->resident = 0;
+            return;
+        }
+        c = &h->chunks[h->nspilled];
+        if (c->z != NULL) {
+            // packed already; small enough to keep
+            return;
+        }
+        n = pwrite(h->spillfd, c->data, c->len, h->spillend);
+        if (n < 0 || (size_t)n != c->len) {
+            if (n < 0) {
+                perror("hist: pwrite");
+            } else {
+                fprintf(stderr, "hist: short write to spill file\n");
+            }
+            h->resident = 0;
+            return;
+        }
+        free(c->data);
+        c->data = NULL;
+        hist_droplines(c);
+        c->spill = h->spillend;
+        c->used = 0;
+        h->spillend += HistChunkSize;
+        h->nspilled++;
+    }
+}
+
+// Lets go of every spilled or packed chunk h has loaded.
+static void hist_cool(Hist *h) {
+    int i;
+    for (i = 0; i < h->nchunks && h->nloaded > 0; i++) {
+        if ((h->chunks[i].spill >= 0 || h->chunks[i].z != NULL) &&
+            h->chunks[i].data != NULL) {
+            hist_unload(h, &h->chunks[i]);
+        }
+    }
+}
+
+// Moves h to the front of the hot list,
+// cooling whichever history falls off the end.
+static void hist_touch(Hist *h) {
+    int i;
+    if (hot[0] == h) {
+        return;
+    }
+    for (i = 1; i < HistHot-1; i++) {
+        if (hot[i] == h) {
+            break;
+        }
+    }
+    if (hot[i] != h && hot[i] != NULL) {
+        hist_cool(hot[i]);
+    }
+    memmove(hot+1, hot, i * sizeof hot[0]);
+    hot[0] = h;
+}
+
+static void hist_unpack(HistChunk *c) {
+    uLongf n = HistChunkSize;
+    c->data = malloc(HistChunkSize);
+    if (c->data == NULL) {
+        perror("hist: malloc");
+        exit(1);
+    }
+    if (uncompress((Bytef*)c->data, &n, (Bytef*)c->z, c->zlen) != Z_OK || n != c->len) {
+        fprintf(stderr, "hist: couldn't unpack chunk\n");
+        exit(1);
+    }
+}
+
+// Loads a spilled or packed chunk that isn't in memory.
+static void hist_load(Hist *h, int i) {
+    HistChunk *c = &h->chunks[i];
+    void *p;
+    int j, lru;
+    if (h->nloaded >= HistLoaded) {
+        lru = -1;
+        for (j = 0; j < h->nchunks; j++) {
+            if ((h->chunks[j].spill >= 0 || h->chunks[j].z != NULL) &&
+                h->chunks[j].data != NULL &&
+                (lru < 0 || h->chunks[j].used < h->chunks[lru].used)) {
+                lru = j;
+            }
+        }
+        hist_unload(h, &h->chunks[lru]);
+    }
+    if (c->z != NULL) {
+        hist_unpack(c);
+    } else {
+        p = mmap(NULL, HistChunkSize, PROT_READ, MAP_SHARED, h->spillfd, c->spill);
+        if (p == MAP_FAILED) {
+            perror("hist: mmap");
+            exit(1);
+        }
+        c->data = p;
+    }
+    hist_findlines(c);
+    h->nloaded++;
+}
+
+// Makes sure the i'th chunk's data is in memory.
+// Only HistLoaded spilled or packed chunks are loaded at once;
+// the one looked at longest ago is let go to make room,
+// so pointers into them don't last long.
+static void hist_map(Hist *h, int i) {
+    HistChunk *c = &h->chunks[i];
+    if (c->spill < 0 && c->z == NULL) {
+        return;
+    }
+    c->used = ++h->clock;
+    if (c->data != NULL) {
+        return;
+    }
+    hist_touch(h);
+    hist_load(h, i);
+}
+
+static bool hist_ishot(Hist *h) {
+    int i;
+    for (i = 0; i < HistHot; i++) {
+        if (hot[i] == h) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Lets go of the chunk hist_peek loaded last,
+// unless its history has been made hot since.
+static void hist_unpeek(void) {
+    Hist *h = peeked;
+    int i;
+    peeked = NULL;
+    if (h == NULL || hist_ishot(h)) {
+        return;
+    }
+    i = hist_findchunk(h, peekedoff);
+    if (i >= 0 && h->chunks[i].off == peekedoff && h->chunks[i].data != NULL &&
+        (h->chunks[i].spill >= 0 || h->chunks[i].z != NULL)) {
+        hist_unload(h, &h->chunks[i]);
+    }
+}
+
+// Makes sure the i'th chunk's line index is in memory.
+// A history that isn't hot isn't made hot just for that:
+// the chunk goes in a single slot shared by all histories,
+// so finding lines in jobs nobody is reading doesn't push
+// the chunks of those that are being read out of memory.
+static void hist_peek(Hist *h, int i) {
+    HistChunk *c = &h->chunks[i];
+    if (c->data != NULL || (c->spill < 0 && c->z == NULL) || hist_ishot(h)) {
+        hist_map(h, i);
+        return;
+    }
+    hist_unpeek();
+    hist_load(h, i);
+    peeked = h;
+    peekedoff = c->off;
+}
+
+static HistChunk* hist_newchunk(Hist *h) {
+    HistChunk *c;
+    if (h->nchunks == h->chunkcap) {
+        void *v;
+        int newcap;
+        newcap = h->chunkcap * 2;
+        if (newcap == 0) {
+            newcap = 16;
+        }
+        if (newcap < h->chunkcap) {
+            printf("hist: overflow\n");
+            exit(1);
+        }
+        v = realloc(h->chunks, newcap * sizeof h->chunks[0]);
+        if (v == NULL) {
+            perror("hist: realloc");
+            exit(1);
+        }
+        h->chunks = v;
+        h->chunkcap = newcap;
+    }
+    c = &h->chunks[h->nchunks];
+    c->data = malloc(HistChunkSize);
+    c->tri = calloc(1, 1 << (HistTriBits-3));
+    if (c->data == NULL || c->tri == NULL) {
+        perror("hist: malloc");
+        exit(1);
+    }
+    c->off = h->len;
+    c->len = 0;
+    c->spill = -1;
+    c->z = NULL;
+    c->zlen = 0;
+    c->used = 0;
+    c->line = h->lastline;
+    c->nlines = 0;
+    c->lines = NULL;
+    c->linecap = 0;
+    c->packing = false;
+    h->nchunks++;
+    held += HistChunkSize;
+    hist_trim(h);
+    hist_trimtotal();
+    hist_spill(h);
+    return &h->chunks[h->nchunks-1];
+}
+
+static unsigned tri_hash(unsigned t) {
+    return (t * 2654435761u) >> (32 - HistTriBits);
+}
+
+// Indexes the lines that end in buf, which is about to go
+// at the end of chunk c.
+static void hist_indexlines(Hist *h, HistChunk *c, const char *buf, size_t len) {
+    const char *p, *end;
+    end = buf + len;
+    for (p = buf; (p = memchr(p, '\n', end-p)) != NULL; p++) {
+        hist_addline(c, c->len + (p-buf) + 1);
+        h->lastline++;
+        h->laststart = c->off + c->len + (p-buf) + 1;
+    }
+}
+
+// Adds the trigrams ending in buf to a chunk's filter.
+// The two bytes before buf are carried over in h->tri.
+static void hist_index(Hist *h, HistChunk *c, const char *buf, size_t len) {
+    unsigned t = h->tri, k;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        t = (t << 8 | (unsigned char)buf[i]) & 0xFFFFFF;
+        k = tri_hash(t);
+        c->tri[k >> 3] |= 1 << (k & 7);
+    }
+    h->tri = t;
+}
+
+void hist_append(Hist *h, char *buf, size_t len) {
+    HistChunk *c;
+    size_t n, room;
+    int k;
+
+    c = NULL;
+    if (h->nchunks > 0 && h->chunks[h->nchunks-1].z == NULL) {
+        // a packed chunk isn't written to again
+        c = &h->chunks[h->nchunks-1];
+    }
+    while (len > 0) {
+        if (c == NULL || c->len == HistChunkSize) {
+            c = hist_newchunk(h);
+        }
+        room = HistChunkSize - c->len;
+        n = len;
+        if (n > room) {
+            // Don't split a utf-8 sequence across two chunks.
+            n = room;
+            for (k = 0; k < 3 && n > 0 && (buf[n] & 0xC0) == 0x80; k++) {
+                n--;
+            }
+            if (n == 0 && c->len > 0) {
+                // leave the rest of this chunk unused
+                c = hist_newchunk(h);
+                continue;
+            }
+            if (n == 0) {
+                n = room;
+            }
+        }
+        memcpy(c->data + c->len, buf, n);
+        hist_indexlines(h, c, buf, n);
+        hist_index(h, c, buf, n);
+        c->len += n;
+        h->len += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+int hist_nchunks(Hist *h) {
+    return h->nchunks;
+}
+
+// Returns a pointer to the i'th chunk and stores its length in *len.
+// Chunks are in order, oldest first.
+char* hist_chunk(Hist *h, int i, size_t *len) {
+    if (i < 0 || i >= h->nchunks) {
+        *len = 0;
+        return NULL;
+    }
+    hist_map(h, i);
+    *len = h->chunks[i].len;
+    return h->chunks[i].data;
+}
+
+// Returns the i'th chunk if it's on the heap and not packed,
+// for compressing. Only call this once the history won't be appended to.
+char* hist_packable(Hist *h, int i, size_t *len) {
+    HistChunk *c;
+    *len = 0;
+    if (i < 0 || i >= h->nchunks) {
+        return NULL;
+    }
+    c = &h->chunks[i];
+    if (c->spill >= 0 || c->z != NULL || c->len == 0) {
+        return NULL;
+    }
+    c->packing = true;
+    *len = c->len;
+    return c->data;
+}
+
+// Swaps the chunk whose data hist_packable returned
+// for a compressed copy, made with zlib's compress,
+// or leaves it as it is if z is NULL. Takes ownership of z.
+// A chunk dropped in the meantime left its data for this to free.
+void hist_pack(Hist *h, char *data, char *z, size_t zlen) {
+    HistChunk *c;
+    int i;
+    for (i = 0; i < h->nchunks; i++) {
+        c = &h->chunks[i];
+        if (c->data == data && c->packing) {
+            c->packing = false;
+            if (z == NULL) {
+                return;
+            }
+            free(c->data);
+            c->data = NULL;
+            hist_droplines(c);
+            c->z = z;
+            c->zlen = zlen;
+            return;
+        }
+    }
+    free(data);
+    free(z);
+}
+
+// Returns the last byte of the history, or -1 if it is empty.
+int hist_lastbyte(Hist *h) {
+    HistChunk *c;
+    if (h->nchunks == 0) {
+        return -1;
+    }
+    hist_map(h, h->nchunks-1);
+    c = &h->chunks[h->nchunks-1];
+    if (c->len == 0) {
+        return -1;
+    }
+    return (unsigned char)c->data[c->len-1];
+}
+
+// Returns the chunk containing the byte at off, or -1.
+static int hist_findchunk(Hist *h, size_t off) {
+    int lo, hi, mid;
+    if (off < h->start || off >= h->len) {
+        return -1;
+    }
+    lo = 0;
+    hi = h->nchunks;
+    while (hi - lo > 1) {
+        mid = lo + (hi-lo)/2;
+        if (h->chunks[mid].off <= off) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Returns a pointer to the byte at off, and stores
+// the number of bytes that follow it in the same chunk in *avail.
+char* hist_ptr(Hist *h, size_t off, size_t *avail) {
+    HistChunk *c;
+    int i;
+    i = hist_findchunk(h, off);
+    if (i < 0) {
+        *avail = 0;
+        return NULL;
+    }
+    hist_map(h, i);
+    c = &h->chunks[i];
+    *avail = c->len - (off - c->off);
+    return c->data + (off - c->off);
+}
+
+// Copies up to len bytes starting at off into buf.
+// Returns the number of bytes copied.
+size_t hist_read(Hist *h, size_t off, char *buf, size_t len) {
+    HistChunk *c;
+    size_t n, total;
+    int i;
+    i = hist_findchunk(h, off);
+    if (i < 0) {
+        return 0;
+    }
+    total = 0;
+    for (; i < h->nchunks && len > 0; i++) {
+        hist_map(h, i);
+        c = &h->chunks[i];
+        if (off < c->off) {
+            off = c->off;
+        }
+        n = c->len - (off - c->off);
+        if (n > len) {
+            n = len;
+        }
+        memcpy(buf+total, c->data + (off - c->off), n);
+        total += n;
+        off += n;
+        len -= n;
+    }
+    return total;
+}
+
+// Reports whether a match starting in chunk i could contain
+// every trigram in pat. A match can run on into the next chunk,
+// whose trigrams are in the next filter.
+static int hist_mightmatch(Hist *h, int i, const char *pat, size_t len) {
+    unsigned char *a, *b;
+    unsigned t, k;
+    size_t j;
+    if (len < 3) {
+        return 1;
+    }
+    a = h->chunks[i].tri;
+    b = i+1 < h->nchunks ? h->chunks[i+1].tri : a;
+    t = (unsigned char)pat[0] << 8 | (unsigned char)pat[1];
+    for (j = 2; j < len; j++) {
+        t = (t << 8 | (unsigned char)pat[j]) & 0xFFFFFF;
+        k = tri_hash(t);
+        if (!((a[k >> 3] | b[k >> 3]) & 1 << (k & 7))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns the first match starting in chunk i at or after from,
+// or h->len. Matches that run on into the next chunk count.
+static size_t hist_findin(Hist *h, int i, size_t from, const char *pat, size_t len) {
+    char buf[2*HistFindMax];
+    HistChunk *c;
+    size_t start, end, n, k;
+
+    hist_map(h, i);
+    c = &h->chunks[i];
+    start = from > c->off ? from - c->off : 0;
+    k = start + findmem(c->data + start, c->len - start, pat, len);
+    if (k < c->len) {
+        return c->off + k;
+    }
+    // across the end of the chunk
+    end = c->off + c->len;
+    if (i+1 >= h->nchunks || len < 2) {
+        return h->len;
+    }
+    start = end - (len-1);
+    if (start < from) {
+        start = from;
+    }
+    if (start < c->off) {
+        start = c->off;
+    }
+    n = hist_read(h, start, buf, end - start + len-1);
+    k = findmem(buf, n, pat, len);
+    if (k < n && start + k < end) {
+        return start + k;
+    }
+    return h->len;
+}
+
+// Returns the last match starting in chunk i before before, or h->len.
+static size_t hist_findlastin(Hist *h, int i, size_t before, const char *pat, size_t len) {
+    char buf[2*HistFindMax];
+    HistChunk *c;
+    size_t start, end, n, k;
+
+    c = &h->chunks[i];
+    end = c->off + c->len;
+    if (before > end) {
+        before = end;
+    }
+    // across the end of the chunk first, since those come last
+    if (i+1 < h->nchunks && len >= 2 && before + len-1 > end) {
+        start = end - (len-1) > c->off ? end - (len-1) : c->off;
+        if (start < before) {
+            n = hist_read(h, start, buf, before - start + len-1);
+            k = findmemlast(buf, n, pat, len);
+            if (k < n && start + k < before) {
+                return start + k;
+            }
+        }
+    }
+    hist_map(h, i);
+    c = &h->chunks[i];
+    n = before - c->off + len-1;
+    if (n > c->len) {
+        n = c->len;
+    }
+    k = findmemlast(c->data, n, pat, len);
+    if (k < n) {
+        return c->off + k;
+    }
+    return h->len;
+}
+
+// Returns the offset of the first match of pat at or after from,
+// or hist's end if there isn't one.
+// Only chunks whose trigram filter has every trigram in pat are read.
+size_t hist_find(Hist *h, size_t from, const char *pat, size_t len) {
+    size_t k;
+    int i;
+    if (len == 0 || len > HistFindMax) {
+        return h->len;
+    }
+    if (from < h->start) {
+        from = h->start;
+    }
+    i = hist_findchunk(h, from);
+    if (i < 0) {
+        return h->len;
+    }
+    for (; i < h->nchunks; i++) {
+        if (!hist_mightmatch(h, i, pat, len)) {
+            continue;
+        }
+        k = hist_findin(h, i, from, pat, len);
+        if (k < h->len) {
+            return k;
+        }
+    }
+    return h->len;
+}
+
+// Returns the offset of the last match of pat that starts before before,
+// or hist's end if there isn't one.
+size_t hist_findback(Hist *h, size_t before, const char *pat, size_t len) {
+    size_t k;
+    int i;
+    if (before > h->len) {
+        before = h->len;
+    }
+    if (len == 0 || len > HistFindMax || before <= h->start) {
+        return h->len;
+    }
+    i = hist_findchunk(h, before - 1);
+    if (i < 0) {
+        return h->len;
+    }
+    for (; i >= 0; i--) {
+        if (!hist_mightmatch(h, i, pat, len)) {
+            continue;
+        }
+        k = hist_findlastin(h, i, before, pat, len);
+        if (k < h->len) {
+            return k;
+        }
+    }
+    return h->len;
+}
+
+// Lines are numbered from the start of the history.
+// Lines before hist_firstline have been dropped.
+// The last line is the one currently being written;
+// it doesn't end in a newline (yet).
+// Every line ever appended is counted, so the numbers are 64-bit.
+long hist_firstline(Hist *h) {
+    if (h->nchunks == 0) {
+        return h->lastline;
+    }
+    return h->chunks[0].line;
+}
+
+long hist_lastline(Hist *h) {
+    return h->lastline;
+}
+
+// Returns where line n starts. n must be held.
+static size_t hist_linestart(Hist *h, long n) {
+    HistChunk *c;
+    int lo, hi, mid;
+    if (h->nchunks == 0 || n <= h->chunks[0].line) {
+        return h->start;
+    }
+    if (n == h->lastline) {
+        return h->laststart;
+    }
+    // the chunk with the newline before it:
+    // the last one whose first line is before n
+    lo = 0;
+    hi = h->nchunks;
+    while (hi - lo > 1) {
+        mid = lo + (hi-lo)/2;
+        if (h->chunks[mid].line < n) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    hist_peek(h, lo);
+    c = &h->chunks[lo];
+    return c->off + c->lines[n-1 - c->line];
+}
+
+// Returns the offset of line n and stores its length,
+// not counting the newline, in *len.
+// The last line is found without loading anything.
+size_t hist_line(Hist *h, long n, size_t *len) {
+    size_t off, end;
+    if (n < hist_firstline(h) || n > h->lastline) {
+        *len = 0;
+        return h->len;
+    }
+    off = hist_linestart(h, n);
+    if (n < h->lastline) {
+        end = hist_linestart(h, n+1) - 1;
+    } else {
+        end = h->len;
+    }
+    *len = end - off;
+    return off;
+}
+
+// Returns the number of the line containing the byte at off.
+long hist_lineat(Hist *h, size_t off) {
+    HistChunk *c;
+    size_t rel;
+    int i, lo, hi, mid;
+    if (off >= h->len) {
+        return h->lastline;
+    }
+    if (off >= h->laststart) {
+        return h->lastline;
+    }
+    i = hist_findchunk(h, off);
+    if (i < 0) {
+        return hist_firstline(h);
+    }
+    hist_peek(h, i);
+    c = &h->chunks[i];
+    // count the lines that start in the chunk at or before off
+    rel = off - c->off;
+    lo = 0;
+    hi = c->nlines;
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        if (c->lines[mid] <= rel) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return c->line + lo;
+}
+
+// Returns the number of the first line that ends in chunk i,
+// and stores how many do in *n and where the chunk starts in *off,
+// without loading it. The line being written isn't counted.
+long hist_chunklines(Hist *h, int i, int *n, size_t *off) {
+    if (i < 0 || i >= h->nchunks) {
+        *n = 0;
+        *off = h->len;
+        return h->lastline;
+    }
+    *n = h->chunks[i].nlines;
+    *off = h->chunks[i].off;
+    return h->chunks[i].line;
+}
@@ -0,0 +1,97 @@
+//#include <stddef.h> /* size_t */
+//#include <stdint.h> /* uint32_t */
+//#include <stdbool.h> /* bool */
+
+// Hist:
+//   append-only scrollback buffer
+//   stored as a list of fixed-size chunks,
+//   so appending never moves bytes that are already there
+//   old chunks can be spilled to a temporary file
+//   and mapped back in when they're looked at
+//   chunks that won't change again can be swapped for a compressed copy
+//   and unpacked when they're looked at
+//   all histories together can be held under a total, which takes
+//   chunks from the oldest histories first
+//   each chunk has a filter of the trigrams in it, kept in memory,
+//   so searching only has to look at chunks that might match
+//   each chunk indexes the lines that end in it; only the count
+//   is kept for a spilled or packed chunk, and the index is found
+//   again from the data when the chunk is loaded
+
+enum {
+    HistChunkSize = 64*1024,
+    HistLoaded = 16, // spilled or packed chunks to keep in memory at once
+    HistHot = 8, // histories that keep any
+    HistTriBits = 14, // log2 of the bits in a chunk's trigram filter
+    HistFindMax = 256, // longest pattern hist_find takes
+};
+
+typedef struct Hist Hist;
+typedef struct HistChunk HistChunk;
+
+struct HistChunk {
+    char *data; // HistChunkSize bytes; NULL if spilled or packed and not loaded
+    size_t off; // offset of data[0] in the history
+    size_t len; // bytes used
+    long long spill; // offset in the spill file, or -1 if on the heap
+    char *z; // compressed copy, or NULL
+    size_t zlen;
+    unsigned long used; // when it was last loaded
+    unsigned char *tri; // trigram filter, 1<<HistTriBits bits
+    bool packing; // data was handed out by hist_packable
+
+    // line index
+    long line; // number of the first line that ends in this chunk
+    int nlines; // lines that end in it, i.e. newlines
+    uint32_t *lines; // where the line after each newline starts,
+                     // relative to off; NULL while data is
+    int linecap;
+};
+
+struct Hist {
+    HistChunk *chunks;
+    int nchunks;
+    int chunkcap;
+
+    size_t start; // offset of the oldest byte still held
+    size_t len; // offset of the end; total bytes ever appended
+    size_t limit; // max bytes of chunks to hold, 0 = unlimited
+    unsigned tri; // the last two bytes appended, for the trigram filter
+
+    // spilling
+    size_t resident; // max bytes of chunks to keep on the heap, 0 = unlimited
+    int nspilled; // chunks[0:nspilled] are in the spill file
+    int nloaded; // spilled or packed chunks that are in memory
+    int spillfd; // -1 until something is spilled
+    long long spillend; // where the next chunk goes in the file
+    unsigned long clock;
+
+    long lastline; // number of the line being written
+    size_t laststart; // where it starts, so it can be found without loading
+
+    // every history, in the order they were made
+    Hist *older;
+    Hist *newer;
+};
+
+void hist_init(Hist *h);
+void hist_free(Hist *h);
+void hist_setlimit(Hist *h, size_t limit);
+void hist_setresident(Hist *h, size_t resident);
+void hist_settotal(size_t total);
+void hist_append(Hist *h, char *buf, size_t len);
+int hist_nchunks(Hist *h);
+char* hist_chunk(Hist *h, int i, size_t *len);
+char* hist_packable(Hist *h, int i, size_t *len);
+void hist_pack(Hist *h, char *data, char *z, size_t zlen);
+int hist_lastbyte(Hist *h);
+char* hist_ptr(Hist *h, size_t off, size_t *avail);
+size_t hist_read(Hist *h, size_t off, char *buf, size_t len);
+size_t hist_find(Hist *h, size_t from, const char *pat, size_t len);
+size_t hist_findback(Hist *h, size_t before, const char *pat, size_t len);
+
+long hist_firstline(Hist *h);
+long hist_lastline(Hist *h);
+size_t hist_line(Hist *h, long n, size_t *len);
+long hist_lineat(Hist *h, size_t off);
+long hist_chunklines(Hist *h, int i, int *n, size_t *off);
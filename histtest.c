@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "hist.h"
+
+// Checks on Hist that don't need a display: run with make test.
+
+static int failed;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "histtest: %s\n", what);
+        failed++;
+    }
+}
+
+// Appends n full chunks of lines.
+static void fill(Hist *h, int n) {
+    static char line[64];
+    size_t i;
+    memset(line, 'x', sizeof line - 1);
+    line[sizeof line - 1] = '\n';
+    for (i = 0; i < (size_t)n * HistChunkSize / sizeof line; i++) {
+        hist_append(h, line, sizeof line);
+    }
+}
+
+// The total cap passes over histories that have nothing to spare:
+// an empty one (a job with no output) and one with a single chunk.
+static void test_total(void) {
+    Hist empty, single, older, newer;
+
+    hist_init(&empty);
+    hist_init(&single);
+    hist_init(&older);
+    hist_init(&newer);
+    fill(&single, 1);
+    fill(&older, 3);
+    hist_settotal(4*HistChunkSize);
+    check(hist_nchunks(&empty) == 0, "empty history grew chunks");
+    check(hist_nchunks(&single) == 1, "single chunk history trimmed");
+    check(hist_nchunks(&older) == 3, "trimmed under the total");
+
+    fill(&newer, 8);
+    check(hist_nchunks(&empty) == 0, "empty history grew chunks");
+    check(hist_nchunks(&single) == 1, "single chunk history lost its last chunk");
+    check(hist_nchunks(&older) == 1, "older history not trimmed first");
+    check(hist_nchunks(&newer) <= 2, "newer history over the total");
+    check(hist_firstline(&older) <= hist_lastline(&older), "older history lines out of order");
+
+    hist_settotal(0);
+    hist_free(&empty);
+    hist_free(&single);
+    hist_free(&older);
+    hist_free(&newer);
+}
+
+int main(void) {
+    test_total();
+    if (failed > 0) {
+        return 1;
+    }
+    printf("histtest: ok\n");
+    return 0;
+}
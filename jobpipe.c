@@ -0,0 +1,29 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include "cmd.h"
+
+// jobpipe:
+//   runs a pipeline for the terminal, which vforks and execs it
+//   as the job's first process in place of /bin/sh
+//   the commands are its children and it exits as the last one did
+//
+//   usage: jobpipe cmdline path...
+//   with the path of each command of the pipeline, as found in $PATH
+
+extern char **environ;
+
+int main(int argc, char *argv[]) {
+    Cmd c;
+    int i;
+
+    if (argc < 2 || cmd_parse(&c, argv[1]) < 0 || c.nprocs != argc - 2) {
+        fprintf(stderr, "usage: jobpipe cmdline path...\n");
+        return 2;
+    }
+    for (i = 0; i < c.nprocs; i++) {
+        c.procs[i].path = argv[i+2];
+    }
+    cmd_pipeline(&c, environ);
+    return 1;
+}
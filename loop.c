@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "loop.h"
+
+enum {
+    LoopMaxEvents = 32,
+};
+
+int loop_init(Loop *l) {
+    l->nhandlers = 0;
+    l->dead = NULL;
+    l->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (l->epfd < 0) {
+        perror("loop_init: epoll_create1");
+        return -1;
+    }
+    return 0;
+}
+
+static void loop_reap(Loop *l) {
+    LoopHandler *h, *next;
+    for (h = l->dead; h != NULL; h = next) {
+        next = h->next;
+        free(h);
+    }
+    l->dead = NULL;
+}
+
+void loop_free(Loop *l) {
+    loop_reap(l);
+    close(l->epfd);
+    l->epfd = -1;
+}
+
+// Calls fn(arg, fd, events) whenever fd is ready.
+// Returns NULL on error.
+LoopHandler* loop_add(Loop *l, int fd, uint32_t events, LoopFunc *fn, void *arg) {
+    struct epoll_event ev;
+    LoopHandler *h;
+
+    h = malloc(sizeof *h);
+    if (h == NULL) {
+        perror("loop_add: malloc");
+        return NULL;
+    }
+    h->fd = fd;
+    h->events = events;
+    h->fn = fn;
+    h->arg = arg;
+    h->next = NULL;
+
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("loop_add: epoll_ctl");
+        free(h);
+        return NULL;
+    }
+    l->nhandlers++;
+    return h;
+}
+
+// Changes the events a handler is waiting for.
+int loop_mod(Loop *l, LoopHandler *h, uint32_t events) {
+    struct epoll_event ev;
+    if (h->events == events) {
+        return 0;
+    }
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_MOD, h->fd, &ev) < 0) {
+        perror("loop_mod: epoll_ctl");
+        return -1;
+    }
+    h->events = events;
+    return 0;
+}
+
+// Removes a handler. It's safe to call this from inside a handler.
+// The fd is not closed.
+void loop_del(Loop *l, LoopHandler *h) {
+    if (h == NULL || h->fn == NULL) {
+        return;
+    }
+    if (epoll_ctl(l->epfd, EPOLL_CTL_DEL, h->fd, NULL) < 0) {
+        perror("loop_del: epoll_ctl");
+    }
+    h->fn = NULL;
+    h->next = l->dead;
+    l->dead = h;
+    l->nhandlers--;
+}
+
+// Waits up to timeout milliseconds (-1 = forever) for something to happen
+// and runs the handlers.
+// Returns the number of handlers that ran, or -1 on error.
+int loop_wait(Loop *l, int timeout) {
+    struct epoll_event ev[LoopMaxEvents];
+    LoopHandler *h;
+    int i, n;
+
+    n = epoll_wait(l->epfd, ev, LoopMaxEvents, timeout);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("epoll_wait");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        h = ev[i].data.ptr;
+        if (h->fn != NULL) {
+            h->fn(h->arg, h->fd, ev[i].events);
+        }
+    }
+    loop_reap(l);
+    return n;
+}
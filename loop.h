@@ -0,0 +1,31 @@
+//#include <stdint.h> /* uint32_t */
+//#include <sys/epoll.h> /* EPOLLIN, EPOLLOUT */
+
+// Loop:
+//   waits for file descriptors with epoll
+//   and calls the handler registered for each one that's ready
+
+typedef struct Loop Loop;
+typedef struct LoopHandler LoopHandler;
+typedef void LoopFunc(void *arg, int fd, uint32_t events);
+
+struct LoopHandler {
+    int fd;
+    uint32_t events;
+    LoopFunc *fn; // NULL once removed
+    void *arg;
+    LoopHandler *next; // on the dead list
+};
+
+struct Loop {
+    int epfd;
+    int nhandlers;
+    LoopHandler *dead; // removed, but maybe still in an event batch
+};
+
+int loop_init(Loop *l);
+void loop_free(Loop *l);
+LoopHandler* loop_add(Loop *l, int fd, uint32_t events, LoopFunc *fn, void *arg);
+int loop_mod(Loop *l, LoopHandler *h, uint32_t events);
+void loop_del(Loop *l, LoopHandler *h);
+int loop_wait(Loop *l, int timeout);
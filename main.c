@@ -1,30 +1,85 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <locale.h>
 #include <errno.h>
 #include <unistd.h>
 #include <termios.h>
+#include <time.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/resource.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/Xrandr.h>
 #include <cairo-xlib.h>
 #include <pango/pangocairo.h>
 #include "utf8.h"
+#include "hist.h"
+#include "path.h"
 #include "shell.h"
+#include "atlas.h"
+#include "sums.h"
+#include "render.h"
+#include "view.h"
+#include "block.h"
+#include "loop.h"
+#include "vt.h"
+#include "stats.h"
+#include "pack.h"
+#include "edit.h"
 #include "term.h"
 
 int debug;
 
 Atom wm_protocols;
 Atom wm_delete_window;
-
-const struct timeval select_timeout = {1, 0}; // 1s
-const struct timespec redraw_interval = {0, 1e9/30}; // 30 fps
+Atom utf8_string;
+Atom incr;
+Atom clipboard;
+Atom paste_property; // where selections are delivered to us
+
+// Output is drawn at most once per frame.
+// Set from the display's refresh rate at startup.
+long frame_interval = 1000000000/60; // nanoseconds
+const size_t hist_limit = 256<<20; // 256 MiB of scrollback per job
+const size_t hist_total = (size_t)1<<30; // 1 GiB for all jobs, oldest trimmed first
+// Scrollback past this much per job is spilled to a file
+// and mapped back in when scrolled to. Set with -m.
+size_t hist_resident = 8<<20;
+
+// How much pty output to take in before going back
+// to check on X events. Set with -b and -t.
+const size_t readbuf_size = 64*1024;
+size_t read_budget = 4<<20; // bytes
+long read_timeslice = 4000; // microseconds
+
+// Output counts as a flood once more than flood_bytes
+// come in before each of flood_frames frames in a row.
+// Lines that scroll by during a flood are never looked at.
+const size_t flood_bytes = 256<<10;
+const int flood_frames = 3;
+
+// Input a job hasn't read yet is queued, up to this much.
+// Past it, typing is dropped and INCR pastes wait
+// for the job to catch up. Set with -q.
+size_t pty_queue_max = 1<<20;
+
+// A paste is given up on if the selection's owner
+// sends nothing for this long.
+const long paste_timeout = 5; // seconds
+
+// Where SIGUSR1 dumps the stats. Set with -s; stderr if not set.
+const char *stats_file;
 
 cairo_surface_t *cairo_create_x11_surface(Display *display, int x, int y) {
     int screen;
@@ -47,7 +102,7 @@ cairo_surface_t *cairo_create_x11_surface(Display *display, int x, int y) {
     XChangeWindowAttributes(display, win, mask, &attr);
 
     // Ask for events.
-    mask = ButtonPressMask | KeyPressMask | ExposureMask | StructureNotifyMask;
+    mask = ButtonPressMask | KeyPressMask | ExposureMask | StructureNotifyMask | PropertyChangeMask;
     XSelectInput(display, win, mask);
     XSetWMProtocols(display, win, &wm_delete_window, 1);
 
@@ -63,91 +118,284 @@ cairo_surface_t *cairo_create_x11_surface(Display *display, int x, int y) {
     return surface;
 }
 
-void draw_text(cairo_t *cr, PangoLayout *layout, cairo_pattern_t *fg, const char* text, size_t len) {
-    cairo_set_source(cr, fg);
-    pango_layout_set_text(layout, text, len);
-    pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
-    pango_cairo_show_layout(cr, layout);
+// Marks part of the window as needing to be repainted.
+void term_damage(Term *t, int x, int y, int width, int height) {
+    cairo_rectangle_int_t r = {x, y, width, height};
+    cairo_region_union_rectangle(t->damage, &r);
+    t->dirty = true;
 }
 
-void draw_cursor(Term *t, int x, int y) {
-    PangoRectangle rect;
-    pango_layout_index_to_pos(t->layout, t->cursor_pos, &rect);
-    pango_extents_to_pixels(&rect, NULL);
-    rect.x += x;
-    rect.y += y;
-    cairo_set_source(t->cr, t->fg);
-    switch (t->cursor_type) {
-    default:
-    case 0:
-        // solid box
-        if (rect.width == 0) {
-            rect.width = t->charwidth;
-        }
-        cairo_rectangle(t->cr, rect.x, rect.y, rect.width, rect.height);
-        cairo_clip(t->cr);
-        cairo_paint(t->cr);
-
-        // redraw glyph
-        cairo_set_source(t->cr, t->bg);
-        cairo_rectangle(t->cr, rect.x, rect.y, rect.width, rect.height);
-        cairo_clip(t->cr);
-        cairo_move_to(t->cr, x, y);
-        // assume we just rendered the text
-        pango_cairo_show_layout(t->cr, t->layout);
-        break;
-    case 1:
-        // box outline
-        cairo_rectangle(t->cr, rect.x+0.5, rect.y+0.5, rect.width-1, rect.height-1);
-        cairo_set_line_width(t->cr, 1);
-        cairo_stroke(t->cr);
-        break;
-    case 2:
-        // vertical line
-        cairo_rectangle(t->cr, rect.x - 1, rect.y, 1, rect.height);
-        cairo_rectangle(t->cr, rect.x - 2, rect.y, 3, 3);
-        cairo_rectangle(t->cr, rect.x - 2, rect.y + rect.height - 3, 3, 3);
-        cairo_fill(t->cr);
-        break;
+void term_damageall(Term *t) {
+    term_damage(t, 0, 0, t->width, t->height);
+}
+
+// Moves what's on screen up by dy pixels (down if dy < 0)
+// and damages the strip that was uncovered.
+// The render thread moves its copy of the last frame,
+// and the window is moved to match when the frame is shown.
+void term_copyscroll(Term *t, int dy) {
+    // damage that hadn't been repainted moved too
+    cairo_region_translate(t->damage, 0, -dy);
+    if (dy > 0) {
+        term_damage(t, 0, t->height - dy, t->width, dy);
+    } else {
+        term_damage(t, 0, 0, t->width, -dy);
     }
 }
 
-void term_redraw(Term *t) {
-    PangoRectangle rect;
-    cairo_push_group(t->cr);
+// Lays out the stats in the top right corner
+// and damages where they were and where they go.
+void term_placestats(Term *t) {
+    char buf[1024];
+    int len, width, height;
+    cairo_region_union_rectangle(t->damage, &t->statsrect);
+    len = stats_summary(&t->stats, buf, sizeof buf);
+    pango_layout_set_text(t->statslayout, buf, len);
+    pango_layout_get_pixel_size(t->statslayout, &width, &height);
+    t->statsrect.width = width + 2*t->border;
+    t->statsrect.height = height + 2*t->border;
+    t->statsrect.x = t->width - t->statsrect.width;
+    t->statsrect.y = 0;
+    cairo_region_union_rectangle(t->damage, &t->statsrect);
+}
 
-    // Draw background
-    cairo_set_source(t->cr, t->bg);
-    cairo_paint(t->cr);
+// Lays out the search bar along the bottom of the window
+// and damages where it was and where it goes.
+void term_placefind(Term *t) {
+    char buf[HistFindMax + 64];
+    int len, height;
+    cairo_region_union_rectangle(t->damage, &t->findrect);
+    len = snprintf(buf, sizeof buf, "find: %.*s%s", t->findlen, t->find,
+        t->findfailed ? "  (not found)" : "");
+    pango_layout_set_text(t->findlayout, buf, len);
+    pango_layout_get_pixel_size(t->findlayout, NULL, &height);
+    t->findrect.x = 0;
+    t->findrect.width = t->width;
+    t->findrect.height = height + 2*t->border;
+    t->findrect.y = t->height - t->findrect.height;
+    cairo_region_union_rectangle(t->damage, &t->findrect);
+}
 
-    // Draw scrollback
-    cairo_move_to(t->cr, t->border, t->border - t->scroll);
-    draw_text(t->cr, t->layout, t->fg, t->hist, t->histlen);
+// Copies the input out in one piece for pango,
+// without moving the edit buffer's gap.
+char* term_inputtext(Term *t, size_t *len) {
+    char *a, *b;
+    size_t alen, blen;
+    edit_segments(&t->edit, &a, &alen, &b, &blen);
+    if (alen + blen >= t->inputcap) {
+        void *v;
+        size_t newcap = t->inputcap * 2;
+        if (newcap < 256) {
+            newcap = 256;
+        }
+        if (newcap <= alen + blen) {
+            newcap = alen + blen + 1;
+        }
+        v = realloc(t->inputtext, newcap);
+        if (v == NULL) {
+            perror("term_inputtext: realloc");
+            exit(1);
+        }
+        t->inputtext = v;
+        t->inputcap = newcap;
+    }
+    memcpy(t->inputtext, a, alen);
+    memcpy(t->inputtext + alen, b, blen);
+    *len = alen + blen;
+    return t->inputtext;
+}
 
-    // Draw input (below scrollback)
-    //pango_layout_get_pixel_extents(t->layout, NULL, &rect);
-    pango_layout_index_to_pos(t->layout, t->histlen, &rect);
-    pango_extents_to_pixels(NULL, &rect);
-    t->inputx = t->border + rect.x;
-    t->inputy = t->border + rect.y;
-    printf("%d,%d\n", rect.x, rect.y);
-    cairo_move_to(t->cr, t->inputx, t->inputy - t->scroll);
-    draw_text(t->cr, t->layout, t->fg, t->edit, t->editlen);
+// Finds where the input goes and damages the rows it covers.
+// Input wraps at the edge of the window,
+// so the whole width is damaged.
+void term_placeinput(Term *t) {
+    char *text;
+    size_t len;
+    int x, y, height;
+    blocks_endpos(&t->blocks, &x, &y);
+    t->inputx = t->border + x;
+    t->inputy = t->border + y;
+    text = term_inputtext(t, &len);
+    pango_layout_set_text(t->layout, text, len);
+    pango_layout_get_pixel_size(t->layout, NULL, &height);
+    if (height < t->charheight) {
+        height = t->charheight;
+    }
+    t->inputrect.x = 0;
+    t->inputrect.y = t->inputy - t->scroll;
+    t->inputrect.width = t->width;
+    t->inputrect.height = height;
+    cairo_region_union_rectangle(t->damage, &t->inputrect);
+}
 
-    // Draw cursor
-    draw_cursor(t, t->border + rect.x, t->border + rect.y - t->scroll);
+// Copies an overlay's text and where it goes into the scene.
+void term_snapbar(Scene *s, SceneBar *b, PangoLayout *layout, cairo_rectangle_int_t rect) {
+    const char *text = pango_layout_get_text(layout);
+    b->shown = true;
+    b->rect = rect;
+    b->len = strlen(text);
+    b->text = scene_text(s, text, b->len);
+}
 
-    cairo_pop_group_to_source(t->cr);
-    cairo_paint(t->cr);
-    cairo_surface_flush(t->surface);
-    t->dirty = false;
+// Copies what the damaged parts of the window show into the scene
+// and hands it to the render thread. The last frame is moved
+// up by dy pixels first.
+// Returns true if another frame is needed for lines that moved.
+bool term_snap(Term *t, int dy) {
+    Scene *s = &t->scene;
+    bool moved = false;
+    char *a, *b;
+    size_t alen, blen, bytes;
+    uint64_t shaped;
+    int pass, x, y;
+
+    if (cairo_region_is_empty(t->damage)) {
+        return false;
+    }
+    for (pass = 0; ; pass++) {
+        scene_clear(s);
+        s->damage = t->damage;
+        t->damage = cairo_region_create();
+        // Only the lines that are on screen and damaged are copied.
+        // Lines that moved as they were looked at are redrawn next frame.
+        if (blocks_snap(&t->blocks, s, t->border - t->scroll, t->height)) {
+            moved = true;
+        }
+
+        // Lines that fit the atlas get their real heights as they're
+        // copied, which may have moved the input.
+        // This doesn't happen often, so just go around again.
+        blocks_endpos(&t->blocks, &x, &y);
+        if (pass > 0 || (t->border + y == t->inputy && t->border + x == t->inputx)) {
+            break;
+        }
+        cairo_region_union(t->damage, s->damage);
+        cairo_region_union_rectangle(t->damage, &t->inputrect);
+        term_placeinput(t);
+        y = t->inputy - t->scroll;
+        if (y < t->height) {
+            term_damage(t, 0, y, t->width, t->height - y);
+        }
+    }
+
+    s->width = t->width;
+    s->height = t->height;
+    s->dy = dy;
+    cairo_pattern_get_rgba(t->fg, &s->fg[0], &s->fg[1], &s->fg[2], &s->fg[3]);
+    cairo_pattern_get_rgba(t->bg, &s->bg[0], &s->bg[1], &s->bg[2], &s->bg[3]);
+    scene_setfonts(s, pango_layout_get_font_description(t->layout),
+        pango_layout_get_font_description(t->statslayout));
+    s->wrap = pango_layout_get_width(t->layout);
+    s->border = t->border;
+
+    // the two halves of the edit buffer land next to each other
+    edit_segments(&t->edit, &a, &alen, &b, &blen);
+    s->input = scene_text(s, a, alen);
+    scene_text(s, b, blen);
+    s->inputlen = alen + blen;
+    s->inputx = t->inputx;
+    s->inputy = t->inputy - t->scroll;
+    s->cursor = t->cursor_pos;
+    s->cursortype = t->cursor_type;
+    s->charwidth = t->charwidth;
+
+    // lines shaped here since the last frame count towards this one
+    shaped = view_shapens(&bytes);
+    s->shapens = shaped - t->shapens;
+    s->shapebytes = bytes - t->shapebytes;
+    t->shapens = shaped;
+    t->shapebytes = bytes;
+
+    if (t->showstats) {
+        term_snapbar(s, &s->stats, t->statslayout, t->statsrect);
+    }
+    if (t->searching) {
+        term_snapbar(s, &s->find, t->findlayout, t->findrect);
+    }
+
+    // Keys handled by now are answered by this frame
+    t->framekey = t->keypending;
+    t->framekeytime = t->keytime;
+    t->keypending = false;
+
+    render_submit(&t->render, s);
+    t->rendering = true;
+    return moved;
+}
+
+// Gets a frame ready with what changed since the last one:
+// new output, the input line and cursor, and whatever scrolling uncovered.
+// Scrolling moves the pixels already drawn instead of redrawing them.
+void term_redraw(Term *t) {
+    long dropped, changed;
+    uint64_t start, shaped;
+    size_t bytes;
+    int dy, copied, y;
+
+    // shaping is a stage of its own
+    shaped = view_shapens(&bytes);
+    start = stats_now();
+    dropped = blocks_update(&t->blocks);
+    stats_add(&t->stats, StatLayout, stats_now() - start - (view_shapens(&bytes) - shaped), 0);
+    t->scroll -= dropped;
+    t->drawnscroll -= dropped;
+    if (t->scroll < 0) {
+        t->scroll = 0;
+    }
+
+    dy = t->scroll - t->drawnscroll;
+    copied = 0;
+    if (dy != 0 && abs(dy) < t->height) {
+        term_copyscroll(t, dy);
+        copied = dy;
+        // the overlays were copied along with everything else
+        if (t->showstats) {
+            term_damage(t, t->statsrect.x, t->statsrect.y - dy,
+                t->statsrect.width, t->statsrect.height);
+        }
+        if (t->searching) {
+            term_damage(t, t->findrect.x, t->findrect.y - dy,
+                t->findrect.width, t->findrect.height);
+        }
+    } else if (dy != 0) {
+        term_damageall(t);
+    }
+    t->drawnscroll = t->scroll;
+
+    // Everything from the first change down may have moved
+    changed = blocks_changed(&t->blocks);
+    if (changed >= 0) {
+        y = t->border + changed - t->scroll;
+        if (y < 0) {
+            y = 0;
+        }
+        if (y < t->height) {
+            term_damage(t, 0, y, t->width, t->height - y);
+        }
+    }
+
+    // The input's old place, moved along with any scrolling
+    t->inputrect.y -= dy;
+    cairo_region_union_rectangle(t->damage, &t->inputrect);
+    term_placeinput(t);
+
+    if (t->showstats) {
+        term_placestats(t);
+    }
+    if (t->searching) {
+        term_placefind(t);
+    }
+
+    t->dirty = term_snap(t, copied);
 }
 
 void term_resize(Term *t, int width, int height) {
     cairo_xlib_surface_set_size(t->surface, width, height);
     pango_layout_set_width(t->layout, (width - 2*t->border)*PANGO_SCALE);
+    blocks_setwidth(&t->blocks, (width - 2*t->border)*PANGO_SCALE);
+    t->width = width;
     t->height = height;
-    t->dirty = true;
+    term_damageall(t);
 }
 
 void term_scroll(Term *t, int dir) {
@@ -159,62 +407,383 @@ void term_scroll(Term *t, int dir) {
 }
 
 void term_movecursor(Term *t, int n) {
+    char *p;
+    size_t len;
     if (n > 0) {
-        n = utf8decode(t->edit+t->cursor_pos, t->editlen-t->cursor_pos, NULL);
-        //printf("%.*s\n", n, t->text+t->cursor_pos);
+        p = edit_after(&t->edit, t->cursor_pos, &len);
+        n = utf8decode(p, len, NULL);
     } else if (n < 0) {
-        n = -utf8decodelast(t->edit, t->cursor_pos, NULL);
-        //printf("%.*s\n", -n, t->edit+t->cursor_pos+n);
+        p = edit_before(&t->edit, t->cursor_pos);
+        n = -utf8decodelast(p, t->cursor_pos, NULL);
     } else {
         return;
     }
     if (t->cursor_pos + n >= 0)
-    if (t->cursor_pos + n <= t->editlen) {
+    if (t->cursor_pos + n <= (int)edit_len(&t->edit)) {
         t->cursor_pos += n;
     }
     t->dirty = true;
 }
 
-void term_appendhist(Term *t, char *buf, size_t len) {
-    if (t->histcap - t->histlen < len) {
-        void *v;
-        int newcap;
-        newcap = t->histcap * 2;
-        if (newcap - t->histlen < len) {
-            newcap = t->histlen + len;
+void term_vtaction(void *arg, VtAction *a);
+void on_pty(void *arg, int fd, uint32_t events);
+
+// Starts a command on its own pty and starts listening to it.
+// The new job gets input unless the command ends in &.
+void term_run(Term *t, char *cmdline) {
+    TermPty *p;
+    Job *job;
+    size_t n;
+    bool bg;
+
+    n = strlen(cmdline);
+    while (n > 0 && cmdline[n-1] == ' ') {
+        n--;
+    }
+    bg = n > 0 && cmdline[n-1] == '&';
+    if (bg) {
+        cmdline[n-1] = '\0';
+    }
+
+    p = malloc(sizeof *p);
+    if (p == NULL) {
+        perror("term_run: malloc");
+        return;
+    }
+    job = shell_run(&t->shell, cmdline);
+    if (job == NULL) {
+        free(p);
+        return;
+    }
+    hist_setlimit(&job->hist, hist_limit);
+    hist_setresident(&job->hist, hist_resident);
+    blocks_add(&t->blocks, job);
+    if (!bg) {
+        blocks_select(&t->blocks, t->blocks.nblocks - 1);
+    }
+
+    p->term = t;
+    p->job = job;
+    p->npartial = 0;
+    p->out = NULL;
+    p->nout = 0;
+    p->outcap = 0;
+    p->outbytes = 0;
+    vt_init(&p->vt, term_vtaction, p);
+    p->handler = loop_add(&t->loop, job->fd, EPOLLIN, on_pty, p);
+    if (p->handler == NULL) {
+        job_close(job);
+        free(p);
+        return;
+    }
+    p->next = t->ptys;
+    t->ptys = p;
+    t->dirty = true;
+}
+
+// Output queue
+//
+// Input for a job is written straight to its pty when nothing is
+// queued; whatever the pty doesn't take is queued, and the rest
+// goes out with writev when epoll says the pty is writable.
+// Nothing here waits for the job.
+
+enum {
+    TermOutChunk = 4096, // small writes are gathered into chunks this big
+    TermOutIov = 64, // chunks per writev
+};
+
+TermPty* term_findpty(Term *t, Job *job) {
+    TermPty *p;
+    for (p = t->ptys; p != NULL; p = p->next) {
+        if (p->job == job) {
+            return p;
         }
-        if (newcap < t->histcap) {
-            printf("overflow\n");
-            exit(1);
+    }
+    return NULL;
+}
+
+void term_pasteread(Term *t);
+
+// Writes as much of the queue as the pty takes.
+// Returns -1 if the pty can't be written to any more.
+int term_ptyflush(Term *t, TermPty *p) {
+    struct iovec iov[TermOutIov];
+    ssize_t n;
+    size_t k;
+    int i, niov;
+
+    while (p->nout > 0) {
+        niov = p->nout < TermOutIov ? p->nout : TermOutIov;
+        for (i = 0; i < niov; i++) {
+            iov[i].iov_base = p->out[i].buf + p->out[i].off;
+            iov[i].iov_len = p->out[i].len - p->out[i].off;
         }
-        if (debug) {
-            printf("resizing hist from %d to %d\n", t->histcap, newcap);
+        n = job_writev(p->job, iov, niov);
+        if (n < 0 && errno == EAGAIN) {
+            break;
         }
-        v = realloc(t->hist, newcap);
-        if (v == NULL) {
-            perror("realloc");
-            exit(1);
+        if (n < 0) {
+            perror("write pty");
+            return -1;
         }
-        t->hist = v;
-        t->histcap = newcap;
+        p->outbytes -= n;
+        for (i = 0; i < p->nout && n > 0; i++) {
+            k = p->out[i].len - p->out[i].off;
+            if ((size_t)n < k) {
+                p->out[i].off += n;
+                break;
+            }
+            n -= k;
+            free(p->out[i].buf);
+        }
+        memmove(p->out, p->out + i, (p->nout - i) * sizeof p->out[0]);
+        p->nout -= i;
     }
-    memmove(t->hist+t->histlen, buf, len);
-    t->histlen += len;
-    t->dirty = true;
+    if (loop_mod(&t->loop, p->handler, p->nout > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN) < 0) {
+        return -1;
+    }
+    if (t->pastepty == p && t->pasteheld && p->outbytes < pty_queue_max) {
+        // the job caught up: ask for the next piece
+        t->pasteheld = false;
+        term_pasteread(t);
+    }
+    return 0;
 }
 
-void term_inserttext(Term *t, char *buf, size_t len) {
-    int i = t->cursor_pos;
-    if (t->editcap - t->editlen < len) {
-        return;
+void term_ptyqueue(TermPty *p, const char *buf, size_t len) {
+    TermOut *o;
+    size_t n;
+
+    while (len > 0) {
+        o = p->nout > 0 ? &p->out[p->nout-1] : NULL;
+        if (o == NULL || o->len == o->cap) {
+            if (p->nout == p->outcap) {
+                void *v;
+                int newcap = p->outcap == 0 ? 8 : p->outcap * 2;
+                v = realloc(p->out, newcap * sizeof p->out[0]);
+                if (v == NULL) {
+                    perror("term_ptyqueue: realloc");
+                    exit(1);
+                }
+                p->out = v;
+                p->outcap = newcap;
+            }
+            o = &p->out[p->nout++];
+            o->cap = len > TermOutChunk ? len : TermOutChunk;
+            o->buf = malloc(o->cap);
+            if (o->buf == NULL) {
+                perror("term_ptyqueue: malloc");
+                exit(1);
+            }
+            o->off = 0;
+            o->len = 0;
+        }
+        n = o->cap - o->len < len ? o->cap - o->len : len;
+        memcpy(o->buf + o->len, buf, n);
+        o->len += n;
+        p->outbytes += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+// Sends input to a job without waiting for it.
+void term_ptywrite(Term *t, TermPty *p, char *buf, size_t len) {
+    ssize_t n = 0;
+    if (p->nout == 0) {
+        n = job_write(p->job, buf, len);
+        if (n < 0 && errno != EAGAIN) {
+            perror("write pty");
+            return;
+        }
+        if (n < 0) {
+            n = 0;
+        }
     }
-    memmove(t->edit+i+len, t->edit+i, t->editlen-i);
-    memmove(t->edit+i, buf, len);
-    t->editlen += len;
+    if ((size_t)n < len) {
+        term_ptyqueue(p, buf + n, len - n);
+        loop_mod(&t->loop, p->handler, EPOLLIN | EPOLLOUT);
+    }
+}
+
+void term_ptyfree(TermPty *p) {
+    int i;
+    for (i = 0; i < p->nout; i++) {
+        free(p->out[i].buf);
+    }
+    free(p->out);
+    p->out = NULL;
+    p->nout = 0;
+    p->outcap = 0;
+    p->outbytes = 0;
+}
+
+// Sends text to the job that has the selection.
+// Dropped if the job is too far behind in reading.
+// The edit line goes with the key that sent it, a newline
+// or a control character, and the two are checked against
+// pty_queue_max together, so the key is never dropped alone.
+// Returns false if they were dropped.
+bool term_send(Term *t, char *buf, size_t len, char key) {
+    Job *job = blocks_selected(&t->blocks);
+    TermPty *p;
+    if (job == NULL) {
+        return false;
+    }
+    p = term_findpty(t, job);
+    if (p == NULL) {
+        return false;
+    }
+    if (p->outbytes >= pty_queue_max) {
+        XBell(t->display, 0);
+        return false;
+    }
+    if (len > 0) {
+        term_ptywrite(t, p, buf, len);
+    }
+    term_ptywrite(t, p, &key, 1);
+    return true;
+}
+
+void term_inserttext(Term *t, char *buf, size_t len) {
+    edit_insert(&t->edit, t->cursor_pos, buf, len);
     t->cursor_pos += len;
     t->dirty = true;
 }
 
+// Paste
+//
+// A selection comes in whole, or with INCR in pieces: the owner
+// sends the next piece each time we delete the property.
+// Text for a job goes through its pty's queue; while the queue
+// is past pty_queue_max, the next piece is left in the property,
+// which holds the owner back to the pace the job reads at.
+
+// Gives the selection's owner paste_timeout to send the next piece,
+// or stops the clock while we aren't waiting on it.
+void term_pastewait(Term *t, bool waiting) {
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    if (waiting) {
+        its.it_value.tv_sec = paste_timeout;
+    }
+    if (timerfd_settime(t->pastetimer, 0, &its, NULL) < 0) {
+        perror("timerfd_settime");
+    }
+}
+
+// Asks for a selection, to go to the job that has input
+// or into the edit line.
+void term_paste(Term *t, Atom selection, Time time) {
+    Window win = cairo_xlib_surface_get_drawable(t->surface);
+    Job *job;
+
+    if (t->pasting) {
+        // one at a time
+        return;
+    }
+    job = blocks_selected(&t->blocks);
+    t->pastepty = NULL;
+    if (job != NULL) {
+        t->pastepty = term_findpty(t, job);
+        if (t->pastepty == NULL) {
+            return;
+        }
+    }
+    t->pasting = true;
+    t->pasteincr = false;
+    t->pasteheld = false;
+    XConvertSelection(t->display, selection, utf8_string, paste_property, win, time);
+    term_pastewait(t, true);
+}
+
+// Stops pasting. Whatever was queued for the pty stays queued.
+void term_pasteend(Term *t) {
+    t->pastepty = NULL;
+    t->pasting = false;
+    t->pasteincr = false;
+    t->pasteheld = false;
+    term_pastewait(t, false);
+}
+
+void term_pastetext(Term *t, char *s, size_t len) {
+    if (t->pastepty != NULL) {
+        term_ptywrite(t, t->pastepty, s, len);
+    } else {
+        term_inserttext(t, s, len);
+    }
+}
+
+// Takes what the owner put in our property. Deleting it
+// (which reading does) asks an INCR owner for the next piece.
+void term_pasteread(Term *t) {
+    Window win = cairo_xlib_surface_get_drawable(t->surface);
+    unsigned long nitems, after, i;
+    unsigned char *data;
+    char *utf8;
+    Atom type;
+    int format;
+    size_t n, k;
+
+    if (XGetWindowProperty(t->display, win, paste_property, 0, 0x1fffffff, True,
+            AnyPropertyType, &type, &format, &nitems, &after, &data) != Success) {
+        term_pasteend(t);
+        return;
+    }
+    if (type == incr) {
+        // the pieces start now that it's deleted
+        t->pasteincr = true;
+        XFree(data);
+        term_pastewait(t, true);
+        return;
+    }
+    n = nitems * format / 8;
+    if (type == XA_STRING && n > 0) {
+        // latin-1, at most two bytes a character in utf-8
+        utf8 = malloc(2*n);
+        if (utf8 == NULL) {
+            perror("term_pasteread: malloc");
+            exit(1);
+        }
+        k = 0;
+        for (i = 0; i < n; i++) {
+            if (data[i] < 0x80) {
+                utf8[k++] = data[i];
+            } else {
+                utf8[k++] = 0xC0 | data[i] >> 6;
+                utf8[k++] = 0x80 | (data[i] & 0x3F);
+            }
+        }
+        term_pastetext(t, utf8, k);
+        free(utf8);
+    } else if (n > 0) {
+        term_pastetext(t, (char*)data, n);
+    }
+    XFree(data);
+    if (!t->pasteincr || n == 0) {
+        // that was all of it
+        term_pasteend(t);
+        return;
+    }
+    term_pastewait(t, true);
+}
+
+// Gives up on a paste whose owner went quiet.
+void on_pastetimer(void *arg, int fd, uint32_t events) {
+    Term *t = arg;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof expirations) < 0 && errno != EAGAIN) {
+        perror("read timerfd");
+    }
+    if (t->pasting) {
+        if (debug) {
+            printf("paste timed out\n");
+        }
+        XDeleteProperty(t->display, cairo_xlib_surface_get_drawable(t->surface), paste_property);
+        term_pasteend(t);
+    }
+}
+
 void term_scrolltoinput(Term *t) {
     if (t->inputy + t->charheight >= t->scroll && t->inputy <= t->scroll+t->height) {
         return;
@@ -237,7 +806,7 @@ void term_scrolltoinput(Term *t) {
 }
 
 void term_kill_line(Term *t) {
-    t->editlen = 0;
+    edit_clear(&t->edit);
     t->cursor_pos = 0;
     t->dirty = true;
 }
@@ -246,14 +815,11 @@ void term_backspace(Term *t) {
     int i = t->cursor_pos;
     int len;
     int32_t r;
-    len = utf8decodelast(t->edit, i, &r);
+    len = utf8decodelast(edit_before(&t->edit, i), i, &r);
     if (len == 0) {
         return;
     }
-    if (i < t->editlen) {
-        memmove(t->edit+i-len, t->edit+i, t->editlen-i);
-    }
-    t->editlen -= len;
+    edit_delete(&t->edit, i-len, len);
     t->cursor_pos -= len;
     t->dirty = true;
 }
@@ -270,10 +836,129 @@ void term_set_font(Term *t, const char *name) {
     height = pango_font_metrics_get_ascent(metrics) +
                     pango_font_metrics_get_descent(metrics);
     pango_font_metrics_unref(metrics);
-    pango_font_description_free(desc);
     t->charwidth = pango_units_to_double(width);
     t->charheight = pango_units_to_double(height);
+    pango_layout_set_font_description(t->findlayout, desc);
+    atlas_setfont(&t->atlas, desc);
+    blocks_setfont(&t->blocks, desc, t->charwidth, t->charheight);
+    pango_font_description_free(desc);
+    term_damageall(t);
+}
+
+void term_findstart(Term *t) {
+    t->searching = true;
+    t->findlen = 0;
+    t->findblock = -1;
+    t->findfailed = false;
+    t->dirty = true;
+}
+
+// Leaves the search, staying where it went.
+void term_findstop(Term *t) {
+    t->searching = false;
+    blocks_setmark(&t->blocks, -1, 0, 0);
+    cairo_region_union_rectangle(t->damage, &t->findrect);
+    t->dirty = true;
+}
+
+// Moves to another match: older if dir < 0, newer if dir > 0.
+// With dir 0 the pattern has changed; the current match stays
+// if it still matches, otherwise the search goes on to older output.
+// The first search starts from the newest output.
+// The match is scrolled to a third of the way down the window.
+void term_findnext(Term *t, int dir) {
+    Blocks *bl = &t->blocks;
+    Hist *h = NULL;
+    size_t pos, k = 0;
+    int i, above;
+
+    if (t->findlen == 0) {
+        t->findblock = -1;
+        t->findfailed = false;
+        blocks_setmark(bl, -1, 0, 0);
+        t->dirty = true;
+        return;
+    }
+    if (dir > 0) {
+        pos = t->findoff + 1;
+        for (i = t->findblock; i >= 0 && i < bl->nblocks; i++) {
+            h = &bl->blocks[i]->job->hist;
+            k = hist_find(h, pos, t->find, t->findlen);
+            if (k < h->len) {
+                break;
+            }
+            pos = 0;
+        }
+    } else {
+        i = t->findblock;
+        pos = t->findoff + (dir == 0);
+        if (i < 0 || i >= bl->nblocks) {
+            i = bl->nblocks - 1;
+            pos = (size_t)-1;
+        }
+        for (; i >= 0; i--) {
+            h = &bl->blocks[i]->job->hist;
+            k = hist_findback(h, pos, t->find, t->findlen);
+            if (k < h->len) {
+                break;
+            }
+            pos = (size_t)-1;
+        }
+    }
     t->dirty = true;
+    if (i < 0 || i >= bl->nblocks) {
+        t->findfailed = true;
+        if (dir == 0) {
+            blocks_setmark(bl, -1, 0, 0);
+        }
+        return;
+    }
+
+    t->findblock = i;
+    t->findoff = k;
+    t->findfailed = false;
+    blocks_setmark(bl, i, k, t->findlen);
+    above = t->height / 3;
+    t->scroll = t->border + blocks_liney(bl, i, hist_lineat(h, k), above) - above;
+    if (t->scroll < 0) {
+        t->scroll = 0;
+    }
+}
+
+// Handles a key while searching. Returns false for keys
+// that should do what they usually do, like paging.
+bool term_findkey(Term *t, KeySym sym, char *buf, int n) {
+    switch (sym) {
+    case XK_Escape:
+        term_findstop(t);
+        return true;
+    case XK_Return:
+    case XK_Up:
+        term_findnext(t, -1);
+        return true;
+    case XK_Down:
+        term_findnext(t, +1);
+        return true;
+    case XK_BackSpace:
+        t->findlen -= utf8decodelast(t->find, t->findlen, NULL);
+        term_findnext(t, 0);
+        return true;
+    }
+    if (n == 1 && buf[0] == 6) {
+        // ^F again
+        term_findnext(t, -1);
+        return true;
+    }
+    if (n > 0 && (unsigned char)buf[0] >= 0x20) {
+        if (t->findlen + n <= (int)sizeof t->find) {
+            memcpy(t->find + t->findlen, buf, n);
+            t->findlen += n;
+            term_findnext(t, 0);
+        }
+        return true;
+    }
+    // other control characters do nothing
+    return n > 0;
 }
 
 void term_swap_colors(Term *t) {
@@ -281,7 +966,7 @@ void term_swap_colors(Term *t) {
     cairo_pattern_t *bg = t->bg;
     t->fg = bg;
     t->bg = fg;
-    t->dirty = true;
+    term_damageall(t);
 }
 
 void xevent(Term *t, XEvent *xev) {
@@ -290,9 +975,41 @@ void xevent(Term *t, XEvent *xev) {
     int n;
     int index;
     int trailing;
+    bool header;
+    int i;
+
+    switch (xev->type) {
+    case ButtonPress:
+    case KeyPress:
+        // Input gets drawn as soon as it's handled.
+        // Time it from here to the flush.
+        if (!t->keypending) {
+            clock_gettime(CLOCK_MONOTONIC, &t->keytime);
+            t->keypending = true;
+        }
+        break;
+    }
 
     switch (xev->type) {
     case ButtonPress:
+        // The middle button pastes
+        if (xev->xbutton.button == Button2) {
+            term_paste(t, XA_PRIMARY, xev->xbutton.time);
+            break;
+        }
+        // Clicking a job's header collapses or expands it
+        i = blocks_find(&t->blocks, xev->xbutton.y - t->border + t->scroll, &header);
+        if (i >= 0 && header) {
+            blocks_collapse(&t->blocks, i, !t->blocks.blocks[i]->collapsed);
+            t->dirty = true;
+            break;
+        }
+        // Clicking a running job's output sends input to it
+        if (i >= 0 && t->blocks.blocks[i]->job->running) {
+            blocks_select(&t->blocks, i);
+            t->dirty = true;
+            break;
+        }
         pango_layout_xy_to_index(t->layout,
             (xev->xbutton.x - t->inputx)*PANGO_SCALE,
             (xev->xbutton.y - t->inputy)*PANGO_SCALE,
@@ -304,25 +1021,32 @@ void xevent(Term *t, XEvent *xev) {
 
     case KeyPress:
         n = Xutf8LookupString(t->ic, &xev->xkey, buf, sizeof buf, &sym, NULL);
+        if (t->searching && term_findkey(t, sym, buf, n)) {
+            break;
+        }
+        // Shift-Insert pastes the primary selection, ^V the clipboard
+        if (sym == XK_Insert && (xev->xkey.state & ShiftMask)) {
+            term_paste(t, XA_PRIMARY, xev->xkey.time);
+            break;
+        }
+        if ((sym == XK_V || sym == XK_v) && (xev->xkey.state & ControlMask) && (xev->xkey.state & ShiftMask)) {
+            term_paste(t, clipboard, xev->xkey.time);
+            break;
+        }
         switch(sym) {
         case XK_Escape:
             t->exiting = true;
             break;
         case XK_Return:
-            if (shell_running(&t->shell)) {
-                shell_write(&t->shell, t->edit, t->editlen);
-                shell_write(&t->shell, "\n", 1);
-            } else {
-                term_appendhist(t, t->edit, t->editlen);
-                term_appendhist(t, "\n", 1);
-                if (t->editlen < t->editcap) {
-                    t->edit[t->editlen] = '\0';
-                    shell_run(&t->shell, t->edit);
-                } else {
-                    // TODO
+            if (blocks_selected(&t->blocks) != NULL) {
+                if (!term_send(t, edit_text(&t->edit), edit_len(&t->edit), '\n')) {
+                    // left in the edit line to send again
+                    break;
                 }
+            } else {
+                term_run(t, edit_text(&t->edit));
             }
-            t->editlen = 0;
+            edit_clear(&t->edit);
             t->cursor_pos = 0;
             break;
         case XK_Left:
@@ -336,7 +1060,7 @@ void xevent(Term *t, XEvent *xev) {
             t->dirty = true;
             break;
         case XK_End:
-            t->cursor_pos = t->editlen;
+            t->cursor_pos = edit_len(&t->edit);
             t->dirty = true;
             break;
         case XK_Page_Up:
@@ -362,6 +1086,22 @@ void xevent(Term *t, XEvent *xev) {
         case XK_F5:
             term_swap_colors(t);
             break;
+        case XK_F6:
+            blocks_collapsedone(&t->blocks);
+            t->dirty = true;
+            break;
+        case XK_F7:
+            blocks_selectnext(&t->blocks);
+            t->dirty = true;
+            break;
+        case XK_F8:
+            t->showstats = !t->showstats;
+            cairo_region_union_rectangle(t->damage, &t->statsrect);
+            t->dirty = true;
+            break;
+        case XK_F9:
+            stats_init(&t->stats);
+            break;
         case XK_BackSpace:
             term_backspace(t);
             break;
@@ -370,16 +1110,19 @@ void xevent(Term *t, XEvent *xev) {
                 // control character.
                 // if a program is running,
                 // flush the buffer and pass it through
-                if (shell_running(&t->shell)) {
+                if (blocks_selected(&t->blocks) != NULL) {
                     printf("keysym %ld, state=%d\n", sym, xev->xkey.state);
-                    shell_write(&t->shell, t->edit, t->editlen);
-                    shell_write(&t->shell, buf, 1);
-                    t->editlen = 0;
-                    t->cursor_pos = 0;
+                    if (term_send(t, edit_text(&t->edit), edit_len(&t->edit), buf[0])) {
+                        edit_clear(&t->edit);
+                        t->cursor_pos = 0;
+                    }
                 } else {
                     if (buf[0] == 4) {
                         // ^D
                         t->exiting = true;
+                    } else if (buf[0] == 6) {
+                        // ^F
+                        term_findstart(t);
                     } else if (buf[0] == 21) {
                         // ^U
                         term_kill_line(t);
@@ -406,6 +1149,37 @@ void xevent(Term *t, XEvent *xev) {
         }
         break;
 
+    case SelectionNotify:
+        if (!t->pasting) {
+            break;
+        }
+        if (xev->xselection.property == None) {
+            if (xev->xselection.target == utf8_string) {
+                // an older owner might still have plain text
+                XConvertSelection(t->display, xev->xselection.selection, XA_STRING,
+                    paste_property, xev->xselection.requestor, xev->xselection.time);
+                term_pastewait(t, true);
+                break;
+            }
+            term_pasteend(t);
+            break;
+        }
+        term_pasteread(t);
+        break;
+
+    case PropertyNotify:
+        if (t->pasteincr && xev->xproperty.atom == paste_property &&
+            xev->xproperty.state == PropertyNewValue) {
+            if (t->pastepty != NULL && t->pastepty->outbytes >= pty_queue_max) {
+                // waiting on the job now, not the owner
+                t->pasteheld = true;
+                term_pastewait(t, false);
+            } else {
+                term_pasteread(t);
+            }
+        }
+        break;
+
     case ConfigureNotify:
         if (debug) {
             fprintf(stderr, "got configure event\n");
@@ -415,7 +1189,17 @@ void xevent(Term *t, XEvent *xev) {
 
     case Expose:
         //fprintf(stderr, "got exposure event\n");
-        term_redraw(t);
+        term_damage(t, xev->xexpose.x, xev->xexpose.y,
+            xev->xexpose.width, xev->xexpose.height);
+        break;
+
+    case GraphicsExpose:
+        // part of a scroll copied from somewhere we couldn't see
+        term_damage(t, xev->xgraphicsexpose.x, xev->xgraphicsexpose.y,
+            xev->xgraphicsexpose.width, xev->xgraphicsexpose.height);
+        break;
+
+    case NoExpose:
         break;
 
     default:
@@ -423,204 +1207,585 @@ void xevent(Term *t, XEvent *xev) {
     }
 }
 
-void printcsi(char *p, int len) {
-    int i, n, r;
-    for (i = 0; i < len; i += n) {
-        n = utf8decode(p+i, len-i, &r);
-        if (0x40 <= r && r <= 0x7F) {
-            i += n;
-            break;
+void vt_debug(VtAction *a) {
+    int i, j;
+    switch (a->type) {
+    case VtControl:
+        printf("^%c\n", a->final ^ 0x40);
+        break;
+    case VtEsc:
+        printf("^[%.*s%c\n", a->ninter, a->inter, a->final);
+        break;
+    case VtCsi:
+        printf("^[[");
+        if (a->private) {
+            printf("%c", a->private);
         }
+        for (i = 0; i < a->nparams; i++) {
+            if (a->params[i] >= 0) {
+                printf("%d", a->params[i]);
+            }
+            for (j = 0; j < a->nsubs[i]; j++) {
+                printf(":");
+                if (a->subs[i][j] >= 0) {
+                    printf("%d", a->subs[i][j]);
+                }
+            }
+            if (i+1 < a->nparams) {
+                printf(";");
+            }
+        }
+        printf("%.*s%c\n", a->ninter, a->inter, a->final);
+        break;
+    case VtOsc:
+        printf("^[]%.*s\n", (int)a->len, a->s);
+        break;
     }
-    printf("%.*s", i, p);
 }
 
-void printctls(char *p, int len) {
-    int i, n, r;
-    for (i = 0; i < len;) {
-        n = utf8decode(p+i, len-i, &r);
-        i += n;
-        if (n == 0) {
-            return;
+// Called by the parser for each piece of a job's output.
+// Only text goes into the scrollback;
+// escape sequences aren't interpreted yet.
+void term_vtaction(void *arg, VtAction *a) {
+    TermPty *p = arg;
+    Term *t = p->term;
+    uint64_t start, ns;
+    if (a->type == VtText) {
+        start = stats_now();
+        job_appendhist(p->job, a->s, a->len);
+        ns = stats_now() - start;
+        stats_add(&t->stats, StatAppend, ns, a->len);
+        t->appendns += ns;
+        return;
+    }
+    if (debug && !(a->type == VtControl && a->final == '\r')) {
+        vt_debug(a);
+    }
+}
+
+// Takes in len bytes at the start of the read buffer.
+// The text is checked once here, so everything the parser sees is valid utf-8;
+// ill-formed sequences are replaced. A sequence cut off at the end
+// is kept back until the next read completes it.
+void term_ingest(Term *t, TermPty *p, size_t len) {
+    char *buf = t->readbuf;
+    size_t end, n;
+    uint64_t start;
+
+    start = stats_now();
+    t->appendns = 0;
+    end = utf8complete(buf, len);
+    if (utf8valid(buf, end) != end) {
+        n = utf8fix(t->fixbuf, buf, end);
+        vt_parse(&p->vt, t->fixbuf, n);
+    } else {
+        vt_parse(&p->vt, buf, end);
+    }
+    p->npartial = len - end;
+    memcpy(p->partial, buf + end, p->npartial);
+    stats_add(&t->stats, StatParse, stats_now() - start - t->appendns, end);
+}
+
+// Hands the scrollback of jobs that have exited
+// and whose ptys are closed to the packer.
+// Their output won't change again.
+void term_packdone(Term *t) {
+    Job *job;
+    int i;
+    for (i = 0; i < t->shell.joblen; i++) {
+        job = t->shell.jobs[i];
+        if (!job->running && job->fd < 0 && !job->packed) {
+            pack_hist(&t->pack, &job->hist);
+            job->packed = true;
         }
-        switch (r) {
-        case '\a':
-            printf("^G\n");
-            break;
-        case '\b':
-            printf("^H\n");
-            break;
-        case 13:
-            //printf("^M\n");
-            break;
-        case 0x1B:
-            printf("^[");
-            n = utf8decode(p+i, len-i, &r);
-            i += n;
-            if (n == 0) {
-                return;
+    }
+}
+
+// Stops listening to a job whose pty has nothing more to say.
+void term_closepty(Term *t, TermPty *p) {
+    TermPty **pp;
+    if (p->npartial > 0) {
+        // a sequence left cut off when the output stopped
+        job_appendhist(p->job, "\xEF\xBF\xBD", 3);
+    }
+    if (t->pastepty == p) {
+        term_pasteend(t);
+    }
+    for (pp = &t->ptys; *pp != p; pp = &(*pp)->next) {
+    }
+    *pp = p->next;
+    loop_del(&t->loop, p->handler);
+    job_close(p->job);
+    term_ptyfree(p);
+    free(p);
+    term_packdone(t);
+}
+
+// Reads from a job until it has nothing more to say
+// or we run out of budget for this wakeup.
+// Returns the number of bytes read, or -1 at the end of the output.
+ssize_t term_drain(Term *t, TermPty *p) {
+    struct timespec start, now;
+    ssize_t n, total;
+    uint64_t readstart;
+    long elapsed;
+    int reads;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    total = 0;
+    reads = 0;
+    for (;;) {
+        memcpy(t->readbuf, p->partial, p->npartial);
+        readstart = stats_now();
+        n = job_read(p->job, t->readbuf + p->npartial, t->readbufsize - p->npartial);
+        stats_add(&t->stats, StatRead, stats_now() - readstart, n > 0 ? n : 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            if(r == 0);
-            switch (r) {
-            case '[':
-                printcsi(p+i, len-i);
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
-            default:
-                printf("hmm");
             }
-            printf("\n");
+            // EIO: everyone holding the other end is gone
+            if (errno != EIO) {
+                perror("read pty");
+            }
+            total = -1;
+            break;
+        }
+        if (n == 0) {
+            total = -1;
+            break;
+        }
+        reads++;
+        total += n;
+        term_ingest(t, p, p->npartial + n);
+
+        if ((size_t)total >= read_budget) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec)*1000000 + (now.tv_nsec - start.tv_nsec)/1000;
+        if (elapsed >= read_timeslice) {
             break;
         }
     }
+    if (debug) {
+        printf("drained %zd bytes in %d reads\n", total, reads);
+    }
+    if (reads > 0) {
+        t->dirty = true;
+    }
+    if (total > 0) {
+        t->framebytes += total;
+    }
+    return total;
 }
 
-int event_loop(Term *t) {
-    XEvent xev;
-    struct itimerspec its = {
-        .it_interval = redraw_interval,
-        .it_value = redraw_interval,
-    };
-    struct timeval tv, now, then;
-    char buf[256];
-    fd_set rfd;
-    int nevents;
-    int timerfd;
-    int xfd;
-    int maxfd;
-    int err;
+void on_pty(void *arg, int fd, uint32_t events) {
+    TermPty *p = arg;
+    Term *t = p->term;
+    if ((events & EPOLLOUT) && term_ptyflush(t, p) < 0) {
+        term_closepty(t, p);
+        t->dirty = true;
+        return;
+    }
+    if (!(events & ~EPOLLOUT)) {
+        return;
+    }
+    if (term_drain(t, p) < 0) {
+        term_closepty(t, p);
+        t->dirty = true;
+    }
+}
+
+void on_sigchld(void *arg, int fd, uint32_t events) {
+    Term *t = arg;
+    Job *job;
+    if (debug) {
+        printf("reap\n");
+    }
+    shell_reap(&t->shell);
+    term_packdone(t);
+    // Input goes back to the prompt when the selected job is done.
+    // Its pty is still read until it's empty.
+    job = blocks_selected(&t->blocks);
+    if (job != NULL && !job->running) {
+        blocks_select(&t->blocks, -1);
+    }
+    t->dirty = true;
+}
 
-    xfd = XConnectionNumber(t->display);
+void on_pack(void *arg, int fd, uint32_t events) {
+    Term *t = arg;
+    pack_collect(&t->pack);
+}
 
-    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
-    if (timerfd < 0) {
-        perror("timerfd");
-        return -1;
+void on_xevent(void *arg, int fd, uint32_t events) {
+    Term *t = arg;
+    XEvent xev;
+    uint64_t start;
+    if (debug) {
+        printf("xevent\n");
     }
-    err = timerfd_settime(timerfd, 0, &its, NULL);
-    if (err < 0) {
-        perror("timerfd");
-        return -1;
+    while (XPending(t->display)) {
+        XNextEvent(t->display, &xev);
+        if (XFilterEvent(&xev, None)) {
+            continue;
+        }
+        start = stats_now();
+        xevent(t, &xev);
+        stats_add(&t->stats, StatEvent, stats_now() - start, 0);
     }
+}
 
-    maxfd = shell_fd(&t->shell);
-    if (xfd > maxfd) {
-        maxfd = xfd;
+// Writes the stats to the -s file, or to stderr.
+void term_dumpstats(Term *t) {
+    FILE *f;
+    if (stats_file == NULL) {
+        stats_dump(&t->stats, stderr);
+        return;
     }
-    if (timerfd > maxfd) {
-        maxfd = timerfd;
+    f = fopen(stats_file, "a");
+    if (f == NULL) {
+        perror(stats_file);
+        return;
     }
-    if (selfpipe.r > maxfd) {
-        maxfd = selfpipe.r;
+    stats_dump(&t->stats, f);
+    fclose(f);
+}
+
+void on_sigusr1(void *arg, int fd, uint32_t events) {
+    Term *t = arg;
+    struct signalfd_siginfo si;
+    // empty the signalfd
+    while (read(fd, &si, sizeof si) == sizeof si) {
     }
+    term_dumpstats(t);
+}
 
-    t->exiting = false;
-    while (!t->exiting) {
-        FD_ZERO(&rfd);
-        FD_SET(shell_fd(&t->shell), &rfd);
-        FD_SET(selfpipe.r, &rfd);
-        FD_SET(xfd, &rfd);
-        FD_SET(timerfd, &rfd);
-
-        // timeout = 1 second
-        // because i feel like we shouldn't block forever
-        tv = select_timeout;
-
-        errno = 0;
-        err = select(maxfd+1, &rfd, NULL, NULL, &tv);
-        if (err < 0) {
-            switch(errno) {
-            case EINTR:
-                continue;
-            default:
-                perror("select");
-                return -1;
-            }
-        }
+long elapsed_ns(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec)*1000000000L + (to->tv_nsec - from->tv_nsec);
+}
 
-        if (err == 0) {
-            if (debug) {
-                printf("select timeout\n");
-            }
-            term_redraw(t);
-            continue;
+// Notices when output starts or stops flooding in.
+void term_checkflood(Term *t) {
+    bool flooding;
+    if (t->framebytes > flood_bytes) {
+        t->heavyframes++;
+    } else {
+        t->heavyframes = 0;
+    }
+    t->framebytes = 0;
+    flooding = t->heavyframes >= flood_frames;
+    if (flooding == t->flooding) {
+        return;
+    }
+    if (debug) {
+        printf("flood %s\n", flooding ? "on" : "off");
+    }
+    t->flooding = flooding;
+    blocks_setflood(&t->blocks, flooding);
+}
+
+// Gets a frame ready now and hands it to the render thread.
+// It's shown when the thread is done with it (on_render).
+void term_frame(Term *t) {
+    struct itimerspec off = {{0, 0}, {0, 0}};
+    uint64_t start;
+
+    start = stats_now();
+    term_checkflood(t);
+    term_redraw(t);
+    stats_add(&t->stats, StatFrame, stats_now() - start, 0);
+
+    if (t->timer_armed) {
+        timerfd_settime(t->timerfd, 0, &off, NULL);
+        t->timer_armed = false;
+    }
+}
+
+// Shows a frame the render thread has finished:
+// copies its damaged parts to the window and pushes them to the server.
+void term_present(Term *t, Scene *s) {
+    Drawable win = cairo_xlib_surface_get_drawable(t->surface);
+    cairo_rectangle_int_t r;
+    cairo_region_t *moved;
+    struct timespec now;
+    uint64_t start;
+    long us;
+    int i, n;
+
+    start = stats_now();
+    stats_add(&t->stats, StatShape, s->shapens, s->shapebytes);
+    stats_add(&t->stats, StatPaint, s->paintns, 0);
+    if (s->dy != 0) {
+        cairo_surface_flush(t->surface);
+        if (s->dy > 0) {
+            XCopyArea(t->display, win, win, t->gc, 0, s->dy, s->width, s->height - s->dy, 0, 0);
+        } else {
+            XCopyArea(t->display, win, win, t->gc, 0, 0, s->width, s->height + s->dy, 0, -s->dy);
         }
+        cairo_surface_mark_dirty(t->surface);
+        // damage that came in while the frame was drawn moved too
+        moved = cairo_region_copy(t->damage);
+        cairo_region_translate(moved, 0, -s->dy);
+        cairo_region_union(t->damage, moved);
+        cairo_region_destroy(moved);
+    }
 
-        nevents = err;
+    cairo_save(t->cr);
+    n = cairo_region_num_rectangles(s->damage);
+    for (i = 0; i < n; i++) {
+        cairo_region_get_rectangle(s->damage, i, &r);
+        cairo_rectangle(t->cr, r.x, r.y, r.width, r.height);
+    }
+    cairo_clip(t->cr);
+    cairo_set_source_surface(t->cr, render_surface(&t->render), 0, 0);
+    cairo_paint(t->cr);
+    cairo_restore(t->cr);
+    cairo_surface_flush(t->surface);
+    XFlush(t->display);
+    stats_add(&t->stats, StatFlush, stats_now() - start, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t->lastframe = now;
+    if (t->framekey) {
+        us = elapsed_ns(&t->framekeytime, &now) / 1000;
+        t->nkeys++;
+        t->keysum += us;
+        if (us > t->keymax) {
+            t->keymax = us;
+        }
         if (debug) {
-            gettimeofday(&then, NULL);
+            printf("input latency %ld µs\n", us);
         }
+        t->framekey = false;
+    }
 
-        if (FD_ISSET(shell_fd(&t->shell), &rfd)) {
-            err = shell_read(&t->shell, buf, sizeof buf);
-            if (err < 0) {
-                perror("read shell");
-                continue;
-            }
-            if (debug) {
-                //printf("shell read %d bytes\n", err);
-            }
-            if (err > 0) {
-                printctls(buf, err);
-                term_appendhist(t, buf, err);
-            }
-        }
+    // Lines the frame shaped for the first time may have turned out
+    // taller or shorter than guessed, moving what's below them.
+    if (blocks_measured(&t->blocks, s)) {
+        t->dirty = true;
+    }
+}
 
-        if (FD_ISSET(selfpipe.r, &rfd)) {
-            if (debug) {
-                printf("reap\n");
-            }
-            err = read(selfpipe.r, buf, 1);
-            if (err < 0) {
-                perror("read selfpipe");
-                continue;
-            }
-            shell_reap(&t->shell);
-            if (t->hist[t->histlen-1] != '\n') {
-                term_appendhist(t, "\n", 1);
-            }
-            term_appendhist(t, "% ", 2);
-        }
+void on_render(void *arg, int fd, uint32_t events) {
+    Term *t = arg;
+    Scene *s = render_collect(&t->render);
+    if (s == NULL) {
+        return;
+    }
+    t->rendering = false;
+    term_present(t, s);
+}
 
-        if (FD_ISSET(xfd, &rfd) || XEventsQueued(t->display, QueuedAlready)) {
-            if (debug) {
-                printf("xevent\n");
-            }
-            while (XPending(t->display)) {
-                XNextEvent(t->display, &xev);
-                if (XFilterEvent(&xev, None)) {
-                    continue;
-                }
-                xevent(t, &xev);
-            }
+void on_timer(void *arg, int fd, uint32_t events) {
+    Term *t = arg;
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof expirations) < 0 && errno != EAGAIN) {
+        perror("read timerfd");
+    }
+    t->timer_armed = false;
+    if (t->dirty && !t->rendering) {
+        if (debug) {
+            printf("timer redraw\n");
         }
+        term_frame(t);
+    }
+}
 
-        if (FD_ISSET(timerfd, &rfd)) {
-            err = read(timerfd, buf, sizeof buf);
-            if (t->dirty) {
-                if (debug) {
-                    printf("timer redraw %d, %ld\n", err, *(long*)&buf);
-                }
-                term_redraw(t);
-                XFlush(t->display);
-                // After flushing, x may read queued events
-                // but the xfd won't be readable (because it's already been read)
-            }
+// Decides when to draw, if there's anything to draw.
+// Only one frame is out on the render thread at a time.
+// Input is drawn right away. Output is drawn right away too
+// if the last frame was long enough ago; otherwise it waits
+// for the next frame, so a burst of output costs one frame per refresh.
+// Nothing is armed while idle, so an idle terminal never wakes up.
+void term_schedule_redraw(Term *t) {
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    struct timespec now;
+    long wait;
+
+    if (!t->dirty) {
+        // input that didn't change anything isn't timed
+        t->keypending = false;
+        return;
+    }
+    if (t->rendering) {
+        // the next frame is decided on when this one is shown
+        return;
+    }
+    if (t->keypending) {
+        term_frame(t);
+        return;
+    }
+    if (t->timer_armed) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    wait = frame_interval - elapsed_ns(&t->lastframe, &now);
+    if (wait <= 0) {
+        term_frame(t);
+        return;
+    }
+    its.it_value.tv_nsec = wait;
+    if (timerfd_settime(t->timerfd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime");
+        return;
+    }
+    t->timer_armed = true;
+}
+
+// Returns the refresh rate of the screen in Hz, or 0 if we can't tell.
+int display_rate(Display *display) {
+    XRRScreenConfiguration *conf;
+    int rate;
+    conf = XRRGetScreenInfo(display, DefaultRootWindow(display));
+    if (conf == NULL) {
+        return 0;
+    }
+    rate = XRRConfigCurrentRate(conf);
+    XRRFreeScreenConfigInfo(conf);
+    return rate;
+}
+
+int event_loop(Term *t) {
+    sigset_t mask, oldmask;
+    int sigfd;
+    int n = 0;
+
+    t->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (t->timerfd < 0) {
+        perror("timerfd");
+        return -1;
+    }
+    t->pastetimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (t->pastetimer < 0) {
+        perror("timerfd");
+        close(t->timerfd);
+        return -1;
+    }
+
+    // SIGUSR1 dumps the stats.
+    // The shell has already saved the mask its jobs start with,
+    // so they don't inherit this.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &mask, &oldmask) < 0) {
+        perror("sigprocmask");
+        close(t->timerfd);
+        close(t->pastetimer);
+        return -1;
+    }
+    sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sigfd < 0) {
+        perror("signalfd");
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        close(t->timerfd);
+        close(t->pastetimer);
+        return -1;
+    }
+    t->timer_armed = false;
+    t->keypending = false;
+    t->nkeys = 0;
+    t->keysum = 0;
+    t->keymax = 0;
+    t->framebytes = 0;
+    t->heavyframes = 0;
+    t->flooding = false;
+    clock_gettime(CLOCK_MONOTONIC, &t->lastframe);
+
+    if (loop_init(&t->loop) < 0) {
+        close(sigfd);
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        close(t->timerfd);
+        close(t->pastetimer);
+        return -1;
+    }
+    if (loop_add(&t->loop, shell_sigfd(&t->shell), EPOLLIN, on_sigchld, t) == NULL ||
+        loop_add(&t->loop, XConnectionNumber(t->display), EPOLLIN, on_xevent, t) == NULL ||
+        loop_add(&t->loop, t->timerfd, EPOLLIN, on_timer, t) == NULL ||
+        loop_add(&t->loop, t->pastetimer, EPOLLIN, on_pastetimer, t) == NULL ||
+        loop_add(&t->loop, sigfd, EPOLLIN, on_sigusr1, t) == NULL ||
+        loop_add(&t->loop, pack_fd(&t->pack), EPOLLIN, on_pack, t) == NULL ||
+        loop_add(&t->loop, render_fd(&t->render), EPOLLIN, on_render, t) == NULL) {
+        loop_free(&t->loop);
+        close(sigfd);
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        close(t->timerfd);
+        close(t->pastetimer);
+        return -1;
+    }
+
+    t->exiting = false;
+    while (!t->exiting) {
+        // Xlib may have read events into its queue while we were
+        // flushing or drawing, and then the fd won't be readable.
+        if (XEventsQueued(t->display, QueuedAlready)) {
+            on_xevent(t, XConnectionNumber(t->display), EPOLLIN);
+            continue;
         }
+        term_schedule_redraw(t);
+        XFlush(t->display);
 
-        if (0 && debug) {
-            gettimeofday(&now, NULL);
-            int diff = (now.tv_sec - then.tv_sec)*1000000 + (now.tv_usec - then.tv_usec);
-            printf("handled %d events in %d µ\n", nevents, diff);
+        n = loop_wait(&t->loop, -1);
+        if (n < 0) {
+            break;
         }
     }
 
-    close(timerfd);
-    return 0;
+    if (debug && t->nkeys > 0) {
+        printf("input latency: %ld keys, %ld µs average, %ld µs max\n",
+            t->nkeys, t->keysum / t->nkeys, t->keymax);
+    }
+    if (debug || stats_file != NULL) {
+        term_dumpstats(t);
+    }
+    loop_free(&t->loop);
+    close(sigfd);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    close(t->timerfd);
+    close(t->pastetimer);
+    return n < 0 ? -1 : 0;
 }
 
-int main() {
+void usage(void) {
+    fprintf(stderr, "usage: main [-d] [-b bytes] [-t microseconds] [-m bytes] [-q bytes] [-s statsfile]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    PangoFontDescription *desc;
+    cairo_font_options_t *options;
+    XGCValues gcv;
     Term t;
     int err;
+    int c;
+
+    while ((c = getopt(argc, argv, "db:t:m:q:s:")) != -1) {
+        switch (c) {
+        case 'd':
+            debug = 1;
+            break;
+        case 'b':
+            read_budget = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            read_timeslice = strtol(optarg, NULL, 0);
+            break;
+        case 'm':
+            hist_resident = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            pty_queue_max = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            stats_file = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
 
     setlocale(LC_ALL, "");
     t.display = XOpenDisplay(NULL);
@@ -635,6 +1800,15 @@ int main() {
 
     wm_protocols = XInternAtom(t.display, "WM_PROTOCOLS", 0);
     wm_delete_window = XInternAtom(t.display, "WM_DELETE_WINDOW", 0);
+    utf8_string = XInternAtom(t.display, "UTF8_STRING", 0);
+    incr = XInternAtom(t.display, "INCR", 0);
+    clipboard = XInternAtom(t.display, "CLIPBOARD", 0);
+    paste_property = XInternAtom(t.display, "MAGICAL_PASTE", 0);
+
+    c = display_rate(t.display);
+    if (c > 0) {
+        frame_interval = 1000000000/c;
+    }
 
     t.surface = cairo_create_x11_surface(t.display, 300, 100);
     if (t.surface == NULL) {
@@ -661,26 +1835,66 @@ int main() {
     }
     XSetICFocus(t.ic);
 
+    // Scrolling copies pixels around the window.
+    // Ask for GraphicsExpose events for parts that couldn't be copied.
+    gcv.graphics_exposures = True;
+    t.gc = XCreateGC(t.display, cairo_xlib_surface_get_drawable(t.surface),
+        GCGraphicsExposures, &gcv);
+
+    t.damage = cairo_region_create();
+    t.width = 0;
+    t.height = 0;
+    t.searching = false;
+    t.findlayout = pango_layout_new(pango_layout_get_context(t.layout));
+    atlas_init(&t.atlas, pango_layout_get_context(t.layout));
+    blocks_init(&t.blocks, pango_layout_get_context(t.layout), &t.atlas);
+
     term_set_font(&t, "Sans 16");
 
     XResizeWindow(t.display, cairo_xlib_surface_get_drawable(t.surface),
         t.charwidth*80, t.charheight*24);
-
-    //char text[256] = "Hello, world! Pokémon. ポケモン. ポケットモンスター";
-    char text[256] = "";
-    t.edit = text;
-    t.editlen = strlen(t.edit);
-    t.editcap = sizeof text;
+    t.width = t.charwidth*80;
+    t.height = t.charheight*24;
+    term_damageall(&t);
+
+    edit_init(&t.edit);
+    t.inputtext = NULL;
+    t.inputcap = 0;
+    t.pasting = false;
+    t.pasteincr = false;
+    t.pasteheld = false;
+    t.pastepty = NULL;
+    t.ptys = NULL;
     t.cursor_pos = 0;
     t.cursor_type = 0;
     t.border = 2;
     t.inputx = t.border;
     t.inputy = t.border;
+    t.inputrect.x = 0;
+    t.inputrect.y = 0;
+    t.inputrect.width = 0;
+    t.inputrect.height = 0;
     t.scroll = 0;
+    t.drawnscroll = 0;
+
+    stats_init(&t.stats);
+    t.shapens = 0;
+    t.shapebytes = 0;
+    t.showstats = false;
+    t.statsrect = t.inputrect;
+    t.findrect = t.inputrect;
+    t.statslayout = pango_layout_new(pango_layout_get_context(t.layout));
+    desc = pango_font_description_from_string("Monospace 9");
+    pango_layout_set_font_description(t.statslayout, desc);
+    pango_font_description_free(desc);
 
-    t.hist = NULL;
-    t.histlen = 0;
-    t.histcap = 0;
+    t.readbufsize = readbuf_size;
+    t.readbuf = malloc(t.readbufsize);
+    t.fixbuf = malloc(3*t.readbufsize);
+    if (t.readbuf == NULL || t.fixbuf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
 
     t.fg = cairo_pattern_create_rgb(0, 0, 0);
     t.bg = cairo_pattern_create_rgb(1, 1, 0xd5/255.0);
@@ -689,16 +1903,44 @@ int main() {
     if (err < 0) {
         exit(1);
     }
+    if (pack_init(&t.pack) < 0) {
+        exit(1);
+    }
+    hist_settotal(hist_total);
+
+    // Frames are drawn on their own thread, in the window's font options
+    options = cairo_font_options_create();
+    cairo_surface_get_font_options(t.surface, options);
+    err = render_init(&t.render, options);
+    cairo_font_options_destroy(options);
+    if (err < 0 || render_start(&t.render) < 0) {
+        exit(1);
+    }
+    scene_init(&t.scene);
+    t.rendering = false;
+    t.framekey = false;
+    t.keypending = false;
 
-    term_appendhist(&t, "% ", 2);
     term_redraw(&t);
     XFlush(t.display);
     event_loop(&t);
 
+    render_free(&t.render);
+    scene_free(&t.scene);
+    pack_free(&t.pack);
     shell_exit(&t.shell);
-    free(t.hist);
+    blocks_free(&t.blocks);
+    atlas_free(&t.atlas);
+    free(t.readbuf);
+    free(t.fixbuf);
+    edit_free(&t.edit);
+    free(t.inputtext);
     cairo_pattern_destroy(t.fg);
     cairo_pattern_destroy(t.bg);
+    cairo_region_destroy(t.damage);
+    XFreeGC(t.display, t.gc);
+    g_object_unref(t.statslayout);
+    g_object_unref(t.findlayout);
     g_object_unref(t.layout);
     cairo_destroy(t.cr);
     cairo_surface_destroy(t.surface);
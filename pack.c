@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <zlib.h>
+#include "hist.h"
+#include "pack.h"
+
+static void* pack_main(void *arg);
+
+int pack_init(Pack *pk) {
+    int err;
+    pk->todo = NULL;
+    pk->todotail = &pk->todo;
+    pk->done = NULL;
+    pk->stopping = false;
+    pk->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pk->fd < 0) {
+        perror("pack_init: eventfd");
+        return -1;
+    }
+    pthread_mutex_init(&pk->lock, NULL);
+    pthread_cond_init(&pk->cond, NULL);
+    err = pthread_create(&pk->thread, NULL, pack_main, pk);
+    if (err != 0) {
+        fprintf(stderr, "pack_init: pthread_create: %s\n", strerror(err));
+        pthread_cond_destroy(&pk->cond);
+        pthread_mutex_destroy(&pk->lock);
+        close(pk->fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Gives each chunk back to its history, compressed if it was.
+static void pack_freeitems(PackItem *it) {
+    PackItem *next;
+    for (; it != NULL; it = next) {
+        next = it->next;
+        hist_pack(it->hist, it->data, it->z, it->zlen);
+        free(it);
+    }
+}
+
+// Stops the thread. Whatever it hadn't started on
+// stays as it is.
+void pack_free(Pack *pk) {
+    pthread_mutex_lock(&pk->lock);
+    pk->stopping = true;
+    pthread_cond_signal(&pk->cond);
+    pthread_mutex_unlock(&pk->lock);
+    pthread_join(pk->thread, NULL);
+
+    pack_freeitems(pk->todo);
+    pack_freeitems(pk->done);
+    pk->todo = NULL;
+    pk->todotail = &pk->todo;
+    pk->done = NULL;
+    pthread_cond_destroy(&pk->cond);
+    pthread_mutex_destroy(&pk->lock);
+    close(pk->fd);
+    pk->fd = -1;
+}
+
+int pack_fd(Pack *pk) {
+    return pk->fd;
+}
+
+// Queues every chunk of h that's still on the heap.
+// h must not be appended to or freed from now on
+// (until pack_free).
+void pack_hist(Pack *pk, Hist *h) {
+    PackItem *it, *first, **tail;
+    char *data;
+    size_t len;
+    int i;
+
+    first = NULL;
+    tail = &first;
+    for (i = 0; i < hist_nchunks(h); i++) {
+        data = hist_packable(h, i, &len);
+        if (data == NULL) {
+            continue;
+        }
+        it = malloc(sizeof *it);
+        if (it == NULL) {
+            perror("pack_hist: malloc");
+            exit(1);
+        }
+        it->hist = h;
+        it->data = data;
+        it->len = len;
+        it->z = NULL;
+        it->zlen = 0;
+        it->next = NULL;
+        *tail = it;
+        tail = &it->next;
+    }
+    if (first == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pk->lock);
+    *pk->todotail = first;
+    pk->todotail = tail;
+    pthread_cond_signal(&pk->cond);
+    pthread_mutex_unlock(&pk->lock);
+}
+
+// Swaps in whatever the thread has finished.
+// Called when the eventfd is readable.
+void pack_collect(Pack *pk) {
+    PackItem *it;
+    uint64_t n;
+
+    if (read(pk->fd, &n, sizeof n) < 0 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+    pthread_mutex_lock(&pk->lock);
+    it = pk->done;
+    pk->done = NULL;
+    pthread_mutex_unlock(&pk->lock);
+    pack_freeitems(it);
+}
+
+// Compresses one chunk. Chunks that don't shrink
+// by at least a quarter are left alone.
+static void pack_item(PackItem *it) {
+    uLongf zlen;
+    void *z;
+
+    zlen = compressBound(it->len);
+    z = malloc(zlen);
+    if (z == NULL) {
+        return;
+    }
+    if (compress2(z, &zlen, (Bytef*)it->data, it->len, Z_BEST_SPEED) != Z_OK ||
+        zlen > it->len - it->len/4) {
+        free(z);
+        return;
+    }
+    it->z = realloc(z, zlen);
+    if (it->z == NULL) {
+        it->z = z;
+    }
+    it->zlen = zlen;
+}
+
+static void* pack_main(void *arg) {
+    Pack *pk = arg;
+    PackItem *it;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&pk->lock);
+    for (;;) {
+        while (pk->todo == NULL && !pk->stopping) {
+            pthread_cond_wait(&pk->cond, &pk->lock);
+        }
+        if (pk->stopping) {
+            break;
+        }
+        it = pk->todo;
+        pk->todo = it->next;
+        if (pk->todo == NULL) {
+            pk->todotail = &pk->todo;
+        }
+        pthread_mutex_unlock(&pk->lock);
+
+        pack_item(it);
+
+        pthread_mutex_lock(&pk->lock);
+        it->next = pk->done;
+        pk->done = it;
+        if (write(pk->fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+            perror("write eventfd");
+        }
+    }
+    pthread_mutex_unlock(&pk->lock);
+    return NULL;
+}
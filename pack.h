@@ -0,0 +1,38 @@
+//#include <stdbool.h> /* bool */
+//#include <pthread.h>
+//#include "hist.h"
+
+// Pack:
+//   compresses the scrollback of finished jobs on a background thread
+//   the thread only reads chunks that won't change again;
+//   the results are swapped in on the main thread,
+//   which learns about them from an eventfd
+
+typedef struct Pack Pack;
+typedef struct PackItem PackItem;
+
+struct PackItem {
+    Hist *hist;
+    char *data; // a chunk from hist_packable
+    size_t len;
+    char *z; // compressed, or NULL if it wasn't worth it
+    size_t zlen;
+    PackItem *next;
+};
+
+struct Pack {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signalled when there's something to do
+    PackItem *todo; // oldest first
+    PackItem **todotail;
+    PackItem *done;
+    bool stopping;
+    int fd; // eventfd, readable when something is done
+};
+
+int pack_init(Pack *pk);
+void pack_free(Pack *pk);
+int pack_fd(Pack *pk);
+void pack_hist(Pack *pk, Hist *h);
+void pack_collect(Pack *pk);
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE // strchrnul, asprintf
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "path.h"
+
+// What sh searches when $PATH isn't set.
+static const char defaultpath[] = "/usr/local/bin:/usr/bin:/bin";
+
+static uint32_t path_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s != '\0'; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+void path_init(Path *p) {
+    p->env = NULL;
+    p->dirs = NULL;
+    p->mtimes = NULL;
+    p->ndirs = 0;
+    p->table = NULL;
+    p->tablecap = 0;
+    p->nentries = 0;
+}
+
+void path_free(Path *p) {
+    int i;
+    for (i = 0; i < p->tablecap; i++) {
+        free(p->table[i].name);
+    }
+    for (i = 0; i < p->ndirs; i++) {
+        free(p->dirs[i]);
+    }
+    free(p->table);
+    free(p->dirs);
+    free(p->mtimes);
+    free(p->env);
+    path_init(p);
+}
+
+static PathEntry* path_slot(PathEntry *table, int cap, const char *name) {
+    uint32_t i = path_hash(name) & (cap - 1);
+    while (table[i].name != NULL && strcmp(table[i].name, name) != 0) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &table[i];
+}
+
+static void path_grow(Path *p) {
+    PathEntry *table, *e;
+    int cap, i;
+
+    cap = p->tablecap == 0 ? 1024 : p->tablecap * 2;
+    table = calloc(cap, sizeof *table);
+    if (table == NULL) {
+        perror("path_grow: calloc");
+        exit(1);
+    }
+    for (i = 0; i < p->tablecap; i++) {
+        if (p->table[i].name != NULL) {
+            e = path_slot(table, cap, p->table[i].name);
+            *e = p->table[i];
+        }
+    }
+    free(p->table);
+    p->table = table;
+    p->tablecap = cap;
+}
+
+// Adds every name in one directory that isn't already
+// in an earlier one.
+static void path_scan(Path *p, int dir) {
+    struct dirent *d;
+    PathEntry *e;
+    DIR *dp;
+
+    dp = opendir(p->dirs[dir]);
+    if (dp == NULL) {
+        return;
+    }
+    while ((d = readdir(dp)) != NULL) {
+        if (d->d_name[0] == '.' || d->d_type == DT_DIR) {
+            continue;
+        }
+        if ((p->nentries + 1) * 4 > p->tablecap * 3) {
+            path_grow(p);
+        }
+        e = path_slot(p->table, p->tablecap, d->d_name);
+        if (e->name != NULL) {
+            continue;
+        }
+        e->name = strdup(d->d_name);
+        if (e->name == NULL) {
+            perror("path_scan: strdup");
+            exit(1);
+        }
+        e->dir = dir;
+        p->nentries++;
+    }
+    closedir(dp);
+}
+
+static void path_rebuild(Path *p, const char *env) {
+    struct stat st;
+    const char *s, *colon;
+    int i;
+
+    path_free(p);
+    p->env = strdup(env);
+    for (s = env; ; s = colon + 1) {
+        colon = strchrnul(s, ':');
+        p->dirs = realloc(p->dirs, (p->ndirs + 1) * sizeof *p->dirs);
+        p->mtimes = realloc(p->mtimes, (p->ndirs + 1) * sizeof *p->mtimes);
+        if (p->env == NULL || p->dirs == NULL || p->mtimes == NULL) {
+            perror("path_rebuild: realloc");
+            exit(1);
+        }
+        // an empty entry means the current directory
+        p->dirs[p->ndirs] = colon == s ? strdup(".") : strndup(s, colon - s);
+        if (p->dirs[p->ndirs] == NULL) {
+            perror("path_rebuild: strdup");
+            exit(1);
+        }
+        p->ndirs++;
+        if (*colon == '\0') {
+            break;
+        }
+    }
+    for (i = 0; i < p->ndirs; i++) {
+        memset(&p->mtimes[i], 0, sizeof p->mtimes[i]);
+        if (stat(p->dirs[i], &st) == 0) {
+            p->mtimes[i] = st.st_mtim;
+        }
+        path_scan(p, i);
+    }
+}
+
+// Whether the table still matches $PATH and its directories.
+// Costs one stat per directory.
+static bool path_current(Path *p, const char *env) {
+    struct stat st;
+    struct timespec t;
+    int i;
+
+    if (p->env == NULL || strcmp(p->env, env) != 0) {
+        return false;
+    }
+    for (i = 0; i < p->ndirs; i++) {
+        memset(&t, 0, sizeof t);
+        if (stat(p->dirs[i], &st) == 0) {
+            t = st.st_mtim;
+        }
+        if (t.tv_sec != p->mtimes[i].tv_sec || t.tv_nsec != p->mtimes[i].tv_nsec) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the file sh would run for the command name,
+// or NULL if there isn't one. Free the result.
+char* path_lookup(Path *p, const char *name) {
+    const char *env;
+    PathEntry *e;
+    char *file;
+
+    if (strchr(name, '/') != NULL) {
+        return access(name, X_OK) == 0 ? strdup(name) : NULL;
+    }
+    env = getenv("PATH");
+    if (env == NULL) {
+        env = defaultpath;
+    }
+    if (!path_current(p, env)) {
+        path_rebuild(p, env);
+    }
+    if (p->tablecap == 0) {
+        return NULL;
+    }
+    e = path_slot(p->table, p->tablecap, name);
+    if (e->name == NULL) {
+        return NULL;
+    }
+    if (asprintf(&file, "%s/%s", p->dirs[e->dir], name) < 0) {
+        perror("path_lookup: asprintf");
+        exit(1);
+    }
+    if (access(file, X_OK) != 0) {
+        // not runnable: let sh find another or complain
+        free(file);
+        return NULL;
+    }
+    return file;
+}
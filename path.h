@@ -0,0 +1,28 @@
+//#include <time.h> /* struct timespec */
+
+// Path:
+//   finds commands in $PATH without searching its directories each time
+//   keeps a hash table of every name in them, rebuilt when $PATH
+//   or the modification time of one of the directories changes
+
+typedef struct Path Path;
+typedef struct PathEntry PathEntry;
+
+struct PathEntry {
+    char *name; // NULL if the slot is free
+    int dir; // index into dirs
+};
+
+struct Path {
+    char *env; // the $PATH the table was built from
+    char **dirs;
+    struct timespec *mtimes;
+    int ndirs;
+    PathEntry *table;
+    int tablecap; // a power of two
+    int nentries;
+};
+
+void path_init(Path *p);
+void path_free(Path *p);
+char* path_lookup(Path *p, const char *name);
@@ -0,0 +1,616 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <pango/pangocairo.h>
+#include "atlas.h"
+#include "stats.h"
+#include "render.h"
+
+static void* render_main(void *arg);
+
+void scene_init(Scene *s) {
+    s->damage = NULL;
+    s->font = NULL;
+    s->statsfont = NULL;
+    s->items = NULL;
+    s->nitems = 0;
+    s->itemcap = 0;
+    s->text = NULL;
+    s->textlen = 0;
+    s->textcap = 0;
+    scene_clear(s);
+}
+
+void scene_free(Scene *s) {
+    scene_clear(s);
+    if (s->font != NULL) {
+        pango_font_description_free(s->font);
+    }
+    if (s->statsfont != NULL) {
+        pango_font_description_free(s->statsfont);
+    }
+    free(s->items);
+    free(s->text);
+    scene_init(s);
+}
+
+// Empties the scene for the next frame.
+// The fonts and the space already allocated are kept.
+void scene_clear(Scene *s) {
+    if (s->damage != NULL) {
+        cairo_region_destroy(s->damage);
+        s->damage = NULL;
+    }
+    s->dy = 0;
+    s->nitems = 0;
+    s->textlen = 0;
+    s->above = 0;
+    s->input = 0;
+    s->inputlen = 0;
+    s->stats.shown = false;
+    s->find.shown = false;
+    s->paintns = 0;
+    s->shapens = 0;
+    s->shapebytes = 0;
+}
+
+static void scene_setfont(PangoFontDescription **font, const PangoFontDescription *desc) {
+    if (*font != NULL && pango_font_description_equal(*font, desc)) {
+        return;
+    }
+    if (*font != NULL) {
+        pango_font_description_free(*font);
+    }
+    *font = pango_font_description_copy(desc);
+}
+
+void scene_setfonts(Scene *s, const PangoFontDescription *font, const PangoFontDescription *statsfont) {
+    scene_setfont(&s->font, font);
+    scene_setfont(&s->statsfont, statsfont);
+}
+
+// Copies text into the scene. Returns where it went.
+size_t scene_text(Scene *s, const char *text, size_t len) {
+    size_t off;
+    if (s->textlen + len > s->textcap) {
+        void *v;
+        size_t newcap = s->textcap * 2;
+        if (newcap < 4096) {
+            newcap = 4096;
+        }
+        if (newcap < s->textlen + len) {
+            newcap = s->textlen + len;
+        }
+        v = realloc(s->text, newcap);
+        if (v == NULL) {
+            perror("scene_text: realloc");
+            exit(1);
+        }
+        s->text = v;
+        s->textcap = newcap;
+    }
+    off = s->textlen;
+    memcpy(s->text + off, text, len);
+    s->textlen += len;
+    return off;
+}
+
+// Adds an item below the others, with a copy of its text.
+// The item is good until the next one is added.
+SceneItem* scene_add(Scene *s, int kind, const char *text, size_t len, long y, int height) {
+    SceneItem *it;
+    if (s->nitems == s->itemcap) {
+        void *v;
+        int newcap;
+        newcap = s->itemcap * 2;
+        if (newcap == 0) {
+            newcap = 64;
+        }
+        if (newcap < s->itemcap) {
+            printf("scene: overflow\n");
+            exit(1);
+        }
+        v = realloc(s->items, newcap * sizeof s->items[0]);
+        if (v == NULL) {
+            perror("scene_add: realloc");
+            exit(1);
+        }
+        s->items = v;
+        s->itemcap = newcap;
+    }
+    it = &s->items[s->nitems++];
+    it->kind = kind;
+    it->text = scene_text(s, text, len);
+    it->len = len;
+    it->y = y;
+    it->height = height;
+    it->guessed = false;
+    it->block = -1;
+    it->gen = 0;
+    it->line = 0;
+    it->markstart = 0;
+    it->markend = 0;
+    return it;
+}
+
+// Sets up for drawing, with fonts of its own
+// so as not to share any pango objects with the main thread.
+// options are the window's, so that text comes out the same.
+int render_init(Render *r, const cairo_font_options_t *options) {
+    int i;
+    r->todo = NULL;
+    r->done = NULL;
+    r->started = false;
+    r->stopping = false;
+    r->fd = -1;
+    r->fontmap = pango_cairo_font_map_new();
+    if (r->fontmap == NULL) {
+        fprintf(stderr, "render_init: couldn't create a font map\n");
+        return -1;
+    }
+    r->context = pango_font_map_create_context(r->fontmap);
+    if (options != NULL) {
+        pango_cairo_context_set_font_options(r->context, options);
+    }
+    r->font = NULL;
+    r->statsfont = NULL;
+    r->header = pango_layout_new(r->context);
+    pango_layout_set_ellipsize(r->header, PANGO_ELLIPSIZE_END);
+    r->input = pango_layout_new(r->context);
+    pango_layout_set_wrap(r->input, PANGO_WRAP_WORD_CHAR);
+    r->find = pango_layout_new(r->context);
+    r->stats = pango_layout_new(r->context);
+    atlas_init(&r->atlas, r->context);
+    r->surface = NULL;
+    for (i = 0; i < RenderCacheSize; i++) {
+        r->cache[i].layout = NULL;
+        r->cache[i].used = 0;
+    }
+    r->clock = 0;
+    return 0;
+}
+
+// Starts the thread. Until then, frames can only be drawn
+// with render_draw.
+int render_start(Render *r) {
+    int err;
+    r->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (r->fd < 0) {
+        perror("render_start: eventfd");
+        return -1;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    err = pthread_create(&r->thread, NULL, render_main, r);
+    if (err != 0) {
+        fprintf(stderr, "render_start: pthread_create: %s\n", strerror(err));
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+    r->started = true;
+    return 0;
+}
+
+// Stops the thread, after the frame it's drawing if any.
+void render_free(Render *r) {
+    int i;
+    if (r->started) {
+        pthread_mutex_lock(&r->lock);
+        r->stopping = true;
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        close(r->fd);
+        r->fd = -1;
+        r->started = false;
+    }
+    r->todo = NULL;
+    r->done = NULL;
+
+    for (i = 0; i < RenderCacheSize; i++) {
+        if (r->cache[i].layout != NULL) {
+            g_object_unref(r->cache[i].layout);
+            r->cache[i].layout = NULL;
+        }
+    }
+    if (r->surface != NULL) {
+        cairo_surface_destroy(r->surface);
+        r->surface = NULL;
+    }
+    atlas_free(&r->atlas);
+    g_object_unref(r->header);
+    g_object_unref(r->input);
+    g_object_unref(r->find);
+    g_object_unref(r->stats);
+    if (r->font != NULL) {
+        pango_font_description_free(r->font);
+        r->font = NULL;
+    }
+    if (r->statsfont != NULL) {
+        pango_font_description_free(r->statsfont);
+        r->statsfont = NULL;
+    }
+    g_object_unref(r->context);
+    g_object_unref(r->fontmap);
+}
+
+int render_fd(Render *r) {
+    return r->fd;
+}
+
+// Hands a scene to the thread. It mustn't be touched
+// until render_collect gives it back.
+void render_submit(Render *r, Scene *s) {
+    pthread_mutex_lock(&r->lock);
+    r->todo = s;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Takes back the scene the thread has finished, or NULL.
+// Called when the eventfd is readable.
+Scene* render_collect(Render *r) {
+    Scene *s;
+    uint64_t n;
+
+    if (read(r->fd, &n, sizeof n) < 0 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+    pthread_mutex_lock(&r->lock);
+    s = r->done;
+    r->done = NULL;
+    pthread_mutex_unlock(&r->lock);
+    return s;
+}
+
+// Returns the last frame drawn. Only good while the thread
+// isn't drawing the next one.
+cairo_surface_t* render_surface(Render *r) {
+    return r->surface;
+}
+
+static void render_setfonts(Render *r, Scene *s) {
+    if (s->font != NULL && (r->font == NULL || !pango_font_description_equal(r->font, s->font))) {
+        if (r->font != NULL) {
+            pango_font_description_free(r->font);
+        }
+        r->font = pango_font_description_copy(s->font);
+        pango_layout_set_font_description(r->header, r->font);
+        pango_layout_set_font_description(r->input, r->font);
+        pango_layout_set_font_description(r->find, r->font);
+        atlas_setfont(&r->atlas, r->font);
+    }
+    if (s->statsfont != NULL && (r->statsfont == NULL || !pango_font_description_equal(r->statsfont, s->statsfont))) {
+        if (r->statsfont != NULL) {
+            pango_font_description_free(r->statsfont);
+        }
+        r->statsfont = pango_font_description_copy(s->statsfont);
+        pango_layout_set_font_description(r->stats, r->statsfont);
+    }
+    pango_layout_set_width(r->header, s->wrap);
+    pango_layout_set_width(r->input, s->wrap);
+}
+
+// Makes the image the size of the window.
+// A new image is all damaged.
+static void render_setsize(Render *r, Scene *s) {
+    cairo_rectangle_int_t all = {0, 0, s->width, s->height};
+    if (r->surface != NULL &&
+        cairo_image_surface_get_width(r->surface) == s->width &&
+        cairo_image_surface_get_height(r->surface) == s->height) {
+        return;
+    }
+    if (r->surface != NULL) {
+        cairo_surface_destroy(r->surface);
+    }
+    r->surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+        s->width > 0 ? s->width : 1, s->height > 0 ? s->height : 1);
+    cairo_region_union_rectangle(s->damage, &all);
+    s->dy = 0;
+}
+
+// Moves the last frame up by dy pixels (down if dy < 0).
+static void render_scroll(Render *r, int dy) {
+    unsigned char *data;
+    int stride, height;
+
+    height = cairo_image_surface_get_height(r->surface);
+    if (abs(dy) >= height) {
+        return;
+    }
+    cairo_surface_flush(r->surface);
+    data = cairo_image_surface_get_data(r->surface);
+    stride = cairo_image_surface_get_stride(r->surface);
+    if (data == NULL) {
+        return;
+    }
+    if (dy > 0) {
+        memmove(data, data + (size_t)dy * stride, (size_t)(height - dy) * stride);
+    } else {
+        memmove(data + (size_t)-dy * stride, data, (size_t)(height + dy) * stride);
+    }
+    cairo_surface_mark_dirty(r->surface);
+}
+
+// Returns the layout for a line, shaping it if necessary,
+// and its height in *height.
+static PangoLayout* render_layout(Render *r, Scene *s, SceneItem *it, int *height) {
+    PangoLayout *layout;
+    uint64_t start;
+    int i, lru;
+
+    lru = 0;
+    for (i = 0; i < RenderCacheSize; i++) {
+        if (r->cache[i].layout != NULL && r->cache[i].gen == it->gen && r->cache[i].line == it->line) {
+            if (r->cache[i].len == it->len) {
+                r->cache[i].used = ++r->clock;
+                *height = r->cache[i].height;
+                return r->cache[i].layout;
+            }
+            lru = i;
+            break;
+        }
+        if (r->cache[i].used < r->cache[lru].used) {
+            lru = i;
+        }
+    }
+
+    layout = r->cache[lru].layout;
+    if (layout == NULL) {
+        layout = pango_layout_new(r->context);
+        pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
+    }
+    pango_layout_set_font_description(layout, r->font);
+    pango_layout_set_width(layout, s->wrap);
+    start = stats_now();
+    pango_layout_set_text(layout, s->text + it->text, it->len);
+    pango_layout_get_pixel_size(layout, NULL, height);
+    s->shapens += stats_now() - start;
+    s->shapebytes += it->len;
+
+    r->cache[lru].gen = it->gen;
+    r->cache[lru].line = it->line;
+    r->cache[lru].len = it->len;
+    r->cache[lru].height = *height;
+    r->cache[lru].layout = layout;
+    r->cache[lru].used = ++r->clock;
+    return layout;
+}
+
+// Fills in behind the highlighted part of a line, if it has one.
+// layout is the line's layout, or NULL if it's drawn from the atlas.
+static void render_mark(Render *r, cairo_t *cr, cairo_pattern_t *fg, PangoLayout *layout, SceneItem *it, int x, long y) {
+    PangoLayoutIter *iter;
+    PangoRectangle rect;
+    double red = 0, green = 0, blue = 0, alpha = 1;
+    int *ranges, nranges, i;
+
+    if (it->markend <= it->markstart) {
+        return;
+    }
+    cairo_pattern_get_rgba(fg, &red, &green, &blue, &alpha);
+    cairo_set_source_rgba(cr, red, green, blue, alpha * 0.3);
+    if (layout == NULL) {
+        cairo_rectangle(cr, x + it->markstart * r->atlas.advance, y,
+            (it->markend - it->markstart) * r->atlas.advance, atlas_lineheight(&r->atlas));
+    } else {
+        iter = pango_layout_get_iter(layout);
+        do {
+            pango_layout_iter_get_line_extents(iter, NULL, &rect);
+            pango_layout_line_get_x_ranges(pango_layout_iter_get_line_readonly(iter),
+                it->markstart, it->markend, &ranges, &nranges);
+            for (i = 0; i < nranges; i++) {
+                cairo_rectangle(cr,
+                    x + pango_units_to_double(ranges[2*i]),
+                    y + pango_units_to_double(rect.y),
+                    pango_units_to_double(ranges[2*i+1] - ranges[2*i]),
+                    pango_units_to_double(rect.height));
+            }
+            g_free(ranges);
+        } while (pango_layout_iter_next_line(iter));
+        pango_layout_iter_free(iter);
+    }
+    cairo_fill(cr);
+    cairo_set_source(cr, fg);
+}
+
+// Draws the scrollback, moving items down past lines that
+// turned out taller than guessed (or up, if shorter).
+// Returns how far the input moves.
+static long render_items(Render *r, Scene *s, cairo_t *cr, cairo_pattern_t *fg) {
+    PangoLayout *layout;
+    SceneItem *it;
+    char *p;
+    long y, shift, inputshift;
+    int i, height;
+
+    shift = 0;
+    inputshift = 0;
+    cairo_set_source(cr, fg);
+    for (i = 0; i < s->nitems; i++) {
+        if (i == s->above) {
+            inputshift = shift;
+        }
+        it = &s->items[i];
+        p = s->text + it->text;
+        y = it->y + shift;
+        switch (it->kind) {
+        case SceneHeader:
+            pango_layout_set_text(r->header, p, it->len);
+            cairo_move_to(cr, s->border, y);
+            pango_cairo_show_layout(cr, r->header);
+            break;
+        case SceneSimple:
+            if (r->atlas.ok) {
+                render_mark(r, cr, fg, NULL, it, s->border, y);
+                atlas_draw(&r->atlas, cr, fg, s->border, y, p, it->len);
+                break;
+            }
+            // no atlas here, so shape it after all
+        default:
+        case SceneLine:
+            layout = render_layout(r, s, it, &height);
+            if (it->height < 0) {
+                shift += height + it->height;
+                it->height = height;
+                it->guessed = true;
+            }
+            render_mark(r, cr, fg, layout, it, s->border, y);
+            cairo_move_to(cr, s->border, y);
+            pango_cairo_show_layout(cr, layout);
+            break;
+        }
+    }
+    if (s->above >= s->nitems) {
+        inputshift = shift;
+    }
+    return inputshift;
+}
+
+static void render_bar(cairo_t *cr, PangoLayout *layout, Scene *s, SceneBar *b, cairo_pattern_t *fg, cairo_pattern_t *bg) {
+    if (!b->shown) {
+        return;
+    }
+    cairo_rectangle(cr, b->rect.x, b->rect.y, b->rect.width, b->rect.height);
+    cairo_set_source(cr, fg);
+    cairo_fill(cr);
+    cairo_move_to(cr, b->rect.x + s->border, b->rect.y + s->border);
+    cairo_set_source(cr, bg);
+    pango_layout_set_text(layout, s->text + b->text, b->len);
+    pango_cairo_show_layout(cr, layout);
+}
+
+// Draws the cursor over the input, which was just drawn at (x, y).
+static void render_cursor(Render *r, Scene *s, cairo_t *cr, cairo_pattern_t *fg, cairo_pattern_t *bg, int x, int y) {
+    PangoRectangle rect;
+    pango_layout_index_to_pos(r->input, s->cursor, &rect);
+    pango_extents_to_pixels(&rect, NULL);
+    rect.x += x;
+    rect.y += y;
+    cairo_set_source(cr, fg);
+    switch (s->cursortype) {
+    default:
+    case 0:
+        // solid box
+        if (rect.width == 0) {
+            rect.width = s->charwidth;
+        }
+        cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+        cairo_clip(cr);
+        cairo_paint(cr);
+
+        // redraw glyph
+        cairo_set_source(cr, bg);
+        cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+        cairo_clip(cr);
+        cairo_move_to(cr, x, y);
+        pango_cairo_show_layout(cr, r->input);
+        break;
+    case 1:
+        // box outline
+        cairo_rectangle(cr, rect.x+0.5, rect.y+0.5, rect.width-1, rect.height-1);
+        cairo_set_line_width(cr, 1);
+        cairo_stroke(cr);
+        break;
+    case 2:
+        // vertical line
+        cairo_rectangle(cr, rect.x - 1, rect.y, 1, rect.height);
+        cairo_rectangle(cr, rect.x - 2, rect.y, 3, 3);
+        cairo_rectangle(cr, rect.x - 2, rect.y + rect.height - 3, 3, 3);
+        cairo_fill(cr);
+        break;
+    }
+}
+
+// Paints the damaged parts of a scene into the image,
+// on whichever thread calls it. Guessed heights that it
+// finds out are left in the items.
+void render_draw(Render *r, Scene *s) {
+    cairo_rectangle_int_t rect;
+    cairo_pattern_t *fg, *bg;
+    cairo_t *cr;
+    uint64_t start, shaped;
+    long shift;
+    int i, n;
+
+    start = stats_now();
+    shaped = s->shapens;
+    render_setfonts(r, s);
+    render_setsize(r, s);
+    if (s->dy != 0) {
+        render_scroll(r, s->dy);
+    }
+
+    cr = cairo_create(r->surface);
+    n = cairo_region_num_rectangles(s->damage);
+    for (i = 0; i < n; i++) {
+        cairo_region_get_rectangle(s->damage, i, &rect);
+        cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+    }
+    cairo_clip(cr);
+    fg = cairo_pattern_create_rgba(s->fg[0], s->fg[1], s->fg[2], s->fg[3]);
+    bg = cairo_pattern_create_rgba(s->bg[0], s->bg[1], s->bg[2], s->bg[3]);
+
+    // Draw background
+    cairo_set_source(cr, bg);
+    cairo_paint(cr);
+
+    // Draw scrollback, then the input below it
+    shift = render_items(r, s, cr, fg);
+    cairo_set_source(cr, fg);
+    pango_layout_set_text(r->input, s->text + s->input, s->inputlen);
+    cairo_move_to(cr, s->inputx, s->inputy + shift);
+    pango_cairo_show_layout(cr, r->input);
+
+    // Draw stats and the search bar (the cursor clips)
+    render_bar(cr, r->stats, s, &s->stats, fg, bg);
+    render_bar(cr, r->find, s, &s->find, fg, bg);
+
+    render_cursor(r, s, cr, fg, bg, s->inputx, s->inputy + shift);
+
+    cairo_pattern_destroy(fg);
+    cairo_pattern_destroy(bg);
+    cairo_destroy(cr);
+    cairo_surface_flush(r->surface);
+    s->paintns = stats_now() - start - (s->shapens - shaped);
+}
+
+static void* render_main(void *arg) {
+    Render *r = arg;
+    Scene *s;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (r->todo == NULL && !r->stopping) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        if (r->stopping) {
+            break;
+        }
+        s = r->todo;
+        r->todo = NULL;
+        pthread_mutex_unlock(&r->lock);
+
+        render_draw(r, s);
+
+        pthread_mutex_lock(&r->lock);
+        r->done = s;
+        if (write(r->fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+            perror("write eventfd");
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
@@ -0,0 +1,145 @@
+//#include <stdbool.h> /* bool */
+//#include <stdint.h> /* uint64_t */
+//#include <pthread.h>
+//#include <pango/pangocairo.h>
+//#include "atlas.h"
+
+// Render:
+//   shapes and paints frames on a thread of its own
+//   the main thread copies what a frame shows into a Scene
+//   and hands it over; the thread paints it into an image
+//   and hands it back through an eventfd, ready to be copied
+//   to the window. The main thread doesn't touch the scene
+//   or the image in between, so keys and output keep being
+//   handled while a frame is drawn
+
+enum {
+    RenderCacheSize = 256, // shaped lines to keep around
+};
+
+enum SceneKind {
+    SceneHeader, // a job's header or the prompt: one row, cut short to fit
+    SceneLine, // a line of output, wrapped and shaped with pango
+    SceneSimple, // a line of output that fits the atlas
+};
+
+typedef struct Scene Scene;
+typedef struct SceneItem SceneItem;
+typedef struct SceneBar SceneBar;
+typedef struct Render Render;
+
+// Something in the scrollback, top to bottom.
+// A line whose height was only a guess is moved to its real
+// height when it's shaped, and everything after it moves down
+// by the difference, as if the height had been known all along.
+struct SceneItem {
+    int kind;
+    size_t text; // offset into the scene's text
+    size_t len;
+    long y;
+    int height; // negative if it's a guess, until the thread shapes it
+    bool guessed; // the thread found the real height
+
+    // which line it is, so the real height can be given back
+    int block; // -1 if it isn't a line
+    int gen; // of the view, see view_snap
+    long line;
+
+    size_t markstart; // highlighted bytes of the line,
+    size_t markend; // none if they're equal
+};
+
+// Text in a box over the scrollback: the stats or the search bar.
+struct SceneBar {
+    bool shown;
+    cairo_rectangle_int_t rect;
+    size_t text;
+    size_t len;
+};
+
+struct Scene {
+    int width; // of the window
+    int height;
+    int dy; // move the last frame up this many pixels first, down if < 0
+    cairo_region_t *damage; // what to repaint
+    double fg[4]; // rgba
+    double bg[4];
+    PangoFontDescription *font;
+    PangoFontDescription *statsfont;
+    int wrap; // wrap width in pango units
+    int border;
+
+    SceneItem *items;
+    int nitems;
+    int itemcap;
+    char *text; // the text of everything, one after the other
+    size_t textlen;
+    size_t textcap;
+
+    // the input and the cursor
+    int above; // number of items above the input
+    int inputx;
+    int inputy;
+    size_t input;
+    size_t inputlen;
+    int cursor; // in bytes
+    int cursortype;
+    double charwidth; // of a cursor past the end
+
+    SceneBar stats;
+    SceneBar find;
+
+    uint64_t paintns; // how long the thread took, not counting shaping
+    uint64_t shapens; // how long shaping lines for it took, on either thread
+    size_t shapebytes;
+};
+
+struct Render {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signalled when there's a frame to draw
+    Scene *todo;
+    Scene *done;
+    bool started;
+    bool stopping;
+    int fd; // eventfd, readable when a frame is done
+
+    // only used by whoever is drawing
+    PangoFontMap *fontmap;
+    PangoContext *context;
+    PangoFontDescription *font; // what the layouts are set up for
+    PangoFontDescription *statsfont;
+    PangoLayout *header;
+    PangoLayout *input;
+    PangoLayout *find;
+    PangoLayout *stats;
+    Atlas atlas;
+    cairo_surface_t *surface; // the last frame
+
+    // shaped lines, by view generation, line and length
+    struct {
+        int gen;
+        long line;
+        size_t len;
+        int height;
+        PangoLayout *layout;
+        unsigned long used;
+    } cache[RenderCacheSize];
+    unsigned long clock;
+};
+
+void scene_init(Scene *s);
+void scene_free(Scene *s);
+void scene_clear(Scene *s);
+void scene_setfonts(Scene *s, const PangoFontDescription *font, const PangoFontDescription *statsfont);
+size_t scene_text(Scene *s, const char *text, size_t len);
+SceneItem* scene_add(Scene *s, int kind, const char *text, size_t len, long y, int height);
+
+int render_init(Render *r, const cairo_font_options_t *options);
+int render_start(Render *r);
+void render_free(Render *r);
+int render_fd(Render *r);
+void render_draw(Render *r, Scene *s);
+void render_submit(Render *r, Scene *s);
+Scene* render_collect(Render *r);
+cairo_surface_t* render_surface(Render *r);
@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <time.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <signal.h>
 #include <pty.h>
@@ -12,13 +13,15 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include "hist.h"
+#include "path.h"
+#include "cmd.h"
 #include "shell.h"
 
-struct selfpipe selfpipe;
+extern char **environ;
 
-int pipe2(int pipefd[2], int flags);
-
-static void sigchld();
 void* reallocarray(void* v, size_t nmemb, size_t size) {
     // TODO: check for overflow
     return realloc(v, nmemb*size);
@@ -31,133 +34,330 @@ void cloexec(int fd){
     }
 }
 
+void nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("nonblock: fcntl");
+        return;
+    }
+}
+
+// Returns the path of jobpipe, which is built next to us,
+// or NULL if it isn't there.
+static char* shell_findjobpipe(void) {
+    static const char name[] = "jobpipe";
+    char buf[PATH_MAX];
+    char *p;
+    ssize_t n;
+
+    n = readlink("/proc/self/exe", buf, sizeof buf - sizeof name);
+    if (n < 0) {
+        return NULL;
+    }
+    buf[n] = '\0';
+    p = strrchr(buf, '/');
+    if (p == NULL) {
+        return NULL;
+    }
+    memcpy(p+1, name, sizeof name);
+    if (access(buf, X_OK) < 0) {
+        return NULL;
+    }
+    return strdup(buf);
+}
+
 int shell_init(Shell *sh) {
     int err;
-    int mfd;
-    int sfd;
+    int sigfd;
+    sigset_t mask;
 
-    sh->fd = 0;
-    sh->sfd = 0;
-    sh->pid = 0;
+    sh->sigfd = -1;
     sh->jobs = NULL;
     sh->joblen = 0;
     sh->jobcap = 0;
-
-    err = pipe2((int*)&selfpipe, O_CLOEXEC | O_NONBLOCK);
+    sh->pids = NULL;
+    sh->npids = 0;
+    sh->pidcap = 0;
+    path_init(&sh->path);
+    sh->jobpipe = shell_findjobpipe();
+
+    // Block SIGCHLD and pick it up from a signalfd instead,
+    // so the event loop can wait on it like any other fd.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    err = sigprocmask(SIG_BLOCK, &mask, &sh->sigmask);
     if (err < 0) {
-        perror("shell_init: pipe2");
+        perror("shell_init: sigprocmask");
         return -1;
     }
-
-    // TODO: one pty per command
-    err = openpty(&mfd, &sfd, NULL, NULL, NULL);
-    if (err < 0) {
-        perror("shell_init: openpty");
+    sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sigfd < 0) {
+        perror("shell_init: signalfd");
         return -1;
     }
-    cloexec(mfd);
-    cloexec(sfd);
 
-    tcgetattr(sfd, &sh->tc);
-    sh->tc.c_lflag &= ~ICANON;
-    tcsetattr(sfd, 0, &sh->tc);
+    sh->sigfd = sigfd;
+    return 0;
+}
 
-    signal(SIGCHLD, sigchld);
+static Job* shell_findjob(Shell *sh, pid_t pid) {
+    int mask = sh->pidcap - 1;
+    int i;
+    if (sh->pidcap == 0) {
+        return NULL;
+    }
+    for (i = pid & mask; sh->pids[i] != NULL; i = (i + 1) & mask) {
+        if (sh->pids[i]->pid == pid) {
+            return sh->pids[i];
+        }
+    }
+    return NULL;
+}
 
-    sh->fd = mfd;
-    sh->sfd = sfd;
-    return 0;
+static void shell_addpid(Shell *sh, Job *job) {
+    Job **pids;
+    int cap, mask, i, j;
+
+    if ((sh->npids + 1) * 2 > sh->pidcap) {
+        cap = sh->pidcap == 0 ? 16 : sh->pidcap * 2;
+        pids = calloc(cap, sizeof pids[0]);
+        if (pids == NULL) {
+            perror("shell_addpid: calloc");
+            exit(1);
+        }
+        for (j = 0; j < sh->pidcap; j++) {
+            if (sh->pids[j] != NULL) {
+                for (i = sh->pids[j]->pid & (cap - 1); pids[i] != NULL; i = (i + 1) & (cap - 1)) {
+                }
+                pids[i] = sh->pids[j];
+            }
+        }
+        free(sh->pids);
+        sh->pids = pids;
+        sh->pidcap = cap;
+    }
+    mask = sh->pidcap - 1;
+    for (i = job->pid & mask; sh->pids[i] != NULL; i = (i + 1) & mask) {
+    }
+    sh->pids[i] = job;
+    sh->npids++;
 }
 
-static void sigchld() {
-    static const char byte[1] = {0};
-    write(selfpipe.w, byte, sizeof byte);
+// Removes a pid, moving back later entries of the same run
+// that would no longer be found past the hole.
+static void shell_droppid(Shell *sh, pid_t pid) {
+    int mask = sh->pidcap - 1;
+    int i, j, home;
+
+    if (sh->pidcap == 0) {
+        return;
+    }
+    for (i = pid & mask; sh->pids[i] != NULL && sh->pids[i]->pid != pid; i = (i + 1) & mask) {
+    }
+    if (sh->pids[i] == NULL) {
+        return;
+    }
+    sh->pids[i] = NULL;
+    sh->npids--;
+    for (j = (i + 1) & mask; sh->pids[j] != NULL; j = (j + 1) & mask) {
+        home = sh->pids[j]->pid & mask;
+        // leave it if its home is cyclically in (i, j]
+        if (i <= j ? (home > i && home <= j) : (home > i || home <= j)) {
+            continue;
+        }
+        sh->pids[i] = sh->pids[j];
+        sh->pids[j] = NULL;
+        i = j;
+    }
 }
 
+// Reaps every child that has exited.
+// Pending SIGCHLDs are merged into one, so a single
+// wakeup may stand for several children.
 void shell_reap(Shell *sh) {
+    struct signalfd_siginfo si;
+    struct timespec now;
+    struct rusage ru;
+    Job *job;
     int status;
     pid_t pid;
 
-    pid = waitpid(-1, &status, WNOHANG);
-    if (pid < 0) {
-        perror("shell_reap: waitpid");
-        return;
+    while (read(sh->sigfd, &si, sizeof si) == sizeof si) {
+        // empty the signalfd
     }
 
-    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
-        printf("command exited with status %d\n", WEXITSTATUS(status));
-    }
+    for (;;) {
+        pid = wait4(-1, &status, WNOHANG, &ru);
+        if (pid < 0) {
+            if (errno != ECHILD) {
+                perror("shell_reap: wait4");
+            }
+            return;
+        }
+        if (pid == 0) {
+            return;
+        }
 
-    if (pid != sh->pid) {
-        printf("unknown pid exited: %d\n", pid);
-    } else {
-        sh->pid = 0;
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            printf("command exited with status %d\n", WEXITSTATUS(status));
+        }
+
+        job = shell_findjob(sh, pid);
+        if (job == NULL) {
+            printf("unknown pid exited: %d\n", pid);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        job->status = status;
+        job->rusage = ru;
+        job->wall = (now.tv_sec - job->started.tv_sec) + (now.tv_nsec - job->started.tv_nsec) / 1e9;
+        job->running = false;
+        shell_droppid(sh, pid);
     }
 }
 
 void shell_exit(Shell *sh) {
-    if (sh->pid != 0) {
-        kill(-sh->pid, SIGTERM);
+    Job *job;
+    int i;
+    for (i = 0; i < sh->joblen; i++) {
+        job = sh->jobs[i];
+        if (job->running) {
+            kill(-job->pid, SIGTERM);
+        }
+        job_close(job);
     }
-    close(sh->fd);
-    close(sh->sfd);
-    sh->pid = 0;
-    sh->fd = 0;
-    sh->sfd = 0;
+    close(sh->sigfd);
+    sigprocmask(SIG_SETMASK, &sh->sigmask, NULL);
+    sh->sigfd = -1;
+    free(sh->pids);
+    sh->pids = NULL;
+    sh->npids = 0;
+    sh->pidcap = 0;
+    path_free(&sh->path);
+    free(sh->jobpipe);
+    sh->jobpipe = NULL;
 }
 
-bool shell_running(Shell *sh) {
-    return sh->pid != 0;
+// Returns the most recent job, or NULL if nothing has run yet.
+Job* shell_lastjob(Shell *sh) {
+    if (sh->joblen == 0) {
+        return NULL;
+    }
+    return sh->jobs[sh->joblen-1];
 }
 
-pid_t do_exec(int fd, const char *cmd, char **argv) {
-    long err;
+// Returns the environment jobs get, built before vfork
+// since the child shares our memory and mustn't call setenv.
+// Free only the array; the strings are environ's.
+static char** job_env(void) {
+    static const char *drop[] = {"COLUMNS=", "LINES=", "TERMCAP=", "TERM="};
+    char **env;
+    size_t i, j, n;
 
-    switch (err = fork()) {
-    case -1:
-        perror("fork");
-        exit(1); // XXX
-        break;
+    for (n = 0; environ[n] != NULL; n++) {
+    }
+    env = malloc((n + 2) * sizeof *env);
+    if (env == NULL) {
+        perror("job_env: malloc");
+        exit(1);
+    }
+    n = 0;
+    for (i = 0; environ[i] != NULL; i++) {
+        for (j = 0; j < sizeof drop / sizeof drop[0]; j++) {
+            if (strncmp(environ[i], drop[j], strlen(drop[j])) == 0) {
+                break;
+            }
+        }
+        if (j == sizeof drop / sizeof drop[0]) {
+            env[n++] = environ[i];
+        }
+    }
+    env[n++] = "TERM=magicalterm";
+    env[n] = NULL;
+    return env;
+}
 
-    case 0:
-        dup2(fd, 0);
-        dup2(fd, 1);
-        dup2(fd, 2);
+// Makes the pty the controlling terminal of a new session
+// and puts back the signals the terminal changed. Called in the child.
+static void do_child(int fd, const sigset_t *mask) {
+    dup2(fd, 0);
+    dup2(fd, 1);
+    dup2(fd, 2);
 
-        if (setsid() < 0) {
-            perror("do_exec: setsid");
-        }
+    if (setsid() < 0) {
+        cmd_error("do_exec: setsid");
+    }
 
-        if (ioctl(fd, TIOCSCTTY, 0) < 0) {
-            perror("do_exec: ioctl");
-        }
+    if (ioctl(fd, TIOCSCTTY, 0) < 0) {
+        cmd_error("do_exec: ioctl");
+    }
 
-        unsetenv("COLUMNS");
-        unsetenv("LINES");
-        unsetenv("TERMCAP");
-        setenv("TERM", "magicalterm", 1);
+    // Do we really need to reset all these signals?
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+}
 
-        // Do we really need to reset all these signals?
-        signal(SIGCHLD, SIG_DFL);
-        signal(SIGHUP, SIG_DFL);
-        signal(SIGINT, SIG_DFL);
-        signal(SIGQUIT, SIG_DFL);
-        signal(SIGTERM, SIG_DFL);
-        signal(SIGALRM, SIG_DFL);
+// Starts cmd, or the parsed single command c if it isn't NULL.
+// Uses vfork, so the cost doesn't grow with our heap and mappings
+// the way copying page tables for fork does. We're suspended
+// until the child execs or exits, and the child only makes
+// system calls: no stdio or malloc, whose locks are ours.
+pid_t do_exec(int fd, const sigset_t *mask, char **envp, const char *cmd, char **argv, Cmd *c) {
+    sigset_t all, old;
+    pid_t pid;
+
+    // No signal handler may run in the child while it shares our memory.
+    sigfillset(&all);
+    sigprocmask(SIG_SETMASK, &all, &old);
 
-        execv(cmd, argv);
+    pid = vfork();
+    if (pid == 0) {
+        do_child(fd, mask);
+        if (c != NULL) {
+            cmd_exec(c, envp);
+        }
+        execve(cmd, argv, envp);
 
         // if we get this far, exec failed
-        perror(cmd);
+        cmd_error(cmd);
         for (;;) {
             _exit(253);
         }
-    default:
-        return err;
     }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    if (pid < 0) {
+        perror("vfork");
+        exit(1); // XXX
+    }
+    return pid;
+}
+
+// Parses a command line and finds each command in $PATH.
+// Returns -1 if it has to go through /bin/sh instead.
+static int shell_parse(Shell *sh, const char *cmdline, Cmd *c) {
+    int i;
+    if (cmd_parse(c, cmdline) < 0) {
+        return -1;
+    }
+    if (c->nprocs > 1 && sh->jobpipe == NULL) {
+        return -1;
+    }
+    for (i = 0; i < c->nprocs; i++) {
+        c->procs[i].path = path_lookup(&sh->path, c->procs[i].argv[0]);
+        if (c->procs[i].path == NULL) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-void shell_run(Shell *sh, char *cmdline) {
+Job* shell_run(Shell *sh, char *cmdline) {
     Job *job;
 
     if (sh->joblen == sh->jobcap) {
@@ -182,10 +382,19 @@ void shell_run(Shell *sh, char *cmdline) {
     }
 
     job = job_create(cmdline);
-    job_start(job, sh);
-    sh->pid = job->pid;
+    if (job == NULL) {
+        return NULL;
+    }
+    if (job_start(job, sh) < 0) {
+        free(job->cmdline);
+        hist_free(&job->hist);
+        free(job);
+        return NULL;
+    }
     sh->jobs[sh->joblen] = job;
     sh->joblen++;
+    shell_addpid(sh, job);
+    return job;
 }
 
 Job* job_create(char* cmdline) {
@@ -202,54 +411,103 @@ Job* job_create(char* cmdline) {
     }
     job->dir = "";
     job->pid = 0;
+    job->fd = -1;
     job->status = 0;
-    job->hist = 0;
-    job->histlen = 0;
-    job->histcap = 0;
+    job->wall = 0;
+    memset(&job->rusage, 0, sizeof job->rusage);
+    job->running = false;
+    job->packed = false;
+    hist_init(&job->hist);
     return job;
 }
 
-void job_start(Job* job, Shell* sh) {
+// Starts the job on a pty of its own.
+// Returns -1 if the pty couldn't be opened.
+int job_start(Job* job, Shell* sh) {
     static const char* shellcmd = "/bin/sh";
     char *argv[] = {"sh", "-c", "", 0};
+    char *pipeargv[CmdMaxProcs+3];
+    struct termios tc;
+    Cmd cmd;
+    char **env;
+    int mfd, sfd, i;
     argv[2] = job->cmdline;
 
+    if (openpty(&mfd, &sfd, NULL, NULL, NULL) < 0) {
+        perror("job_start: openpty");
+        return -1;
+    }
+    cloexec(mfd);
+    cloexec(sfd);
+    nonblock(mfd);
+
+    tcgetattr(sfd, &tc);
+    tc.c_lflag &= ~ICANON;
+    tcsetattr(sfd, 0, &tc);
+
     job->ctime = time(NULL);
-    job->pid = do_exec(sh->sfd, shellcmd, argv);
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    env = job_env();
+    // Simple commands skip the shell: one fork and exec
+    // instead of starting sh and having it search $PATH.
+    // A pipeline needs a process to wait for its commands,
+    // and jobpipe is that, given the paths we found.
+    if (shell_parse(sh, job->cmdline, &cmd) < 0) {
+        job->pid = do_exec(sfd, &sh->sigmask, env, shellcmd, argv, NULL);
+    } else if (cmd.nprocs > 1) {
+        pipeargv[0] = "jobpipe";
+        pipeargv[1] = job->cmdline;
+        for (i = 0; i < cmd.nprocs; i++) {
+            pipeargv[i+2] = cmd.procs[i].path;
+        }
+        pipeargv[i+2] = NULL;
+        job->pid = do_exec(sfd, &sh->sigmask, env, sh->jobpipe, pipeargv, NULL);
+    } else {
+        job->pid = do_exec(sfd, &sh->sigmask, env, NULL, NULL, &cmd);
+    }
+    cmd_free(&cmd);
+    free(env);
+    job->fd = mfd;
+    job->running = true;
+
+    // Only the child holds the slave now,
+    // so reads return EIO once everything it started is gone.
+    close(sfd);
+    return 0;
 }
 
-ssize_t shell_read(Shell *sh, char* buf, size_t size) {
-    return read(sh->fd, buf, size);
+// Closes the pty. Any output not read yet is lost.
+void job_close(Job* job) {
+    if (job->fd >= 0) {
+        close(job->fd);
+        job->fd = -1;
+    }
 }
 
-ssize_t shell_write(Shell *sh, char* buf, size_t size) {
-    return write(sh->fd, buf, size);
+ssize_t job_read(Job* job, char* buf, size_t size) {
+    return read(job->fd, buf, size);
 }
 
-int shell_fd(Shell *sh) {
-    return sh->fd;
+ssize_t job_write(Job* job, char* buf, size_t size) {
+    if (job->fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    return write(job->fd, buf, size);
 }
 
-void job_appendhist(Job* job, char* buf, size_t len) {
-    if (job->histcap - job->histlen < len) {
-        void *v;
-        int newcap;
-        newcap = job->histcap * 2;
-        if (newcap - job->histlen < len) {
-            newcap = job->histlen + len;
-        }
-        if (newcap < job->histcap) {
-            printf("overflow\n");
-            exit(1);
-        }
-        v = realloc(job->hist, newcap);
-        if (v == NULL) {
-            perror("realloc");
-            exit(1);
-        }
-        job->hist = v;
-        job->histcap = newcap;
+ssize_t job_writev(Job* job, const struct iovec *iov, int iovcnt) {
+    if (job->fd < 0) {
+        errno = EBADF;
+        return -1;
     }
-    memmove(job->hist+job->histlen, buf, len);
-    job->histlen += len;
+    return writev(job->fd, iov, iovcnt);
+}
+
+int shell_sigfd(Shell *sh) {
+    return sh->sigfd;
+}
+
+void job_appendhist(Job* job, char* buf, size_t len) {
+    hist_append(&job->hist, buf, len);
 }
@@ -1,58 +1,64 @@
 //#include <termios.h> /* struct termios */
+//#include <time.h> /* struct timespec */
 //#include <sys/resource.h> /* struct rusage */
 //#include <stdbool.h> /* bool */
 //#include <unistd.h> /* ssize_t, pid_t */
+//#include <signal.h> /* sigset_t */
+//#include <sys/uio.h> /* struct iovec */
 
 // Shell:
-//  runs jobs
-//  owns the pty
+//  runs jobs, each on its own pty
 //  stores scrollback
 
-struct selfpipe {
-    int r, w;
-};
-extern struct selfpipe selfpipe;
-
 typedef struct Shell Shell;
 typedef struct Job Job;
 
 struct Shell {
-    pid_t pid; // current job
-    int fd;  // pty master
-    int sfd; // pty slave
-
-    struct termios tc;
+    int sigfd; // signalfd for SIGCHLD
+    sigset_t sigmask; // signal mask to restore in children
+    Path path; // where commands are
+    char *jobpipe; // runs pipelines, NULL to leave them to /bin/sh
 
     Job **jobs;
     int joblen;
     int jobcap;
+
+    // running jobs by pid, open addressing on the pid's low bits
+    Job **pids;
+    int npids;
+    int pidcap; // a power of two
 };
 
 struct Job {
     char *cmdline;
     char *dir;
     // TODO: env?
-    struct rusage rusage;
+    struct rusage rusage; // filled in once it exits
 
     pid_t pid; // process id
+    int fd; // pty master, -1 once closed
     int status; // exit status
+    bool running;
+    bool packed; // scrollback handed off to be compressed
     time_t ctime; // start time
+    struct timespec started; // monotonic start time
+    double wall; // seconds it ran for, once it exits
 
     // scrollback buffer
-    char *hist;
-    int histlen;
-    int histcap;
+    Hist hist;
 };
 
 int shell_init(Shell* sh);
-void shell_run(Shell *sh, char *cmdline);
+Job* shell_run(Shell *sh, char *cmdline);
 void shell_exit(Shell *sh);
 void shell_reap(Shell *sh);
-int shell_fd(Shell *sh);
-bool shell_running(Shell *sh);
-ssize_t shell_read(Shell* sh, char* buf, size_t size);
-ssize_t shell_write(Shell* sh, char* buf, size_t size);
+int shell_sigfd(Shell *sh);
+Job* shell_lastjob(Shell *sh);
 
 Job* job_create(char* cmdline);
-void job_start(Job* job, Shell* sh);
+int job_start(Job* job, Shell* sh);
+void job_close(Job* job);
+ssize_t job_read(Job* job, char* buf, size_t size);
+ssize_t job_write(Job* job, char* buf, size_t size);
+ssize_t job_writev(Job* job, const struct iovec *iov, int iovcnt);
 void job_appendhist(Job* job, char* buf, size_t len);
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+static const char *stage_names[StatStages] = {
+    [StatRead] = "read",
+    [StatParse] = "parse",
+    [StatAppend] = "append",
+    [StatLayout] = "layout",
+    [StatShape] = "shape",
+    [StatPaint] = "paint",
+    [StatFlush] = "flush",
+    [StatEvent] = "event",
+    [StatFrame] = "frame",
+};
+
+void stats_init(Stats *s) {
+    memset(s->stages, 0, sizeof s->stages);
+    s->since = stats_now();
+}
+
+// Returns the time on the monotonic clock in nanoseconds.
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static int bucket(uint64_t ns) {
+    int i;
+    if (ns == 0) {
+        return 0;
+    }
+    i = 64 - __builtin_clzll(ns);
+    if (i >= StatBuckets) {
+        i = StatBuckets - 1;
+    }
+    return i;
+}
+
+void stats_add(Stats *s, int stage, uint64_t ns, size_t bytes) {
+    StatHist *h = &s->stages[stage];
+    h->count++;
+    h->sum += ns;
+    h->bytes += bytes;
+    if (ns > h->max) {
+        h->max = ns;
+    }
+    h->buckets[bucket(ns)]++;
+}
+
+// Returns the upper bound of the bucket the pth percentile falls in,
+// so it's within a factor of two, and never more than the max.
+uint64_t stats_percentile(StatHist *h, double p) {
+    uint64_t want, seen;
+    int i;
+    if (h->count == 0) {
+        return 0;
+    }
+    want = p * h->count;
+    if (want >= h->count) {
+        want = h->count - 1;
+    }
+    seen = 0;
+    for (i = 0; i < StatBuckets; i++) {
+        seen += h->buckets[i];
+        if (seen > want) {
+            break;
+        }
+    }
+    // bucket 0 only holds zeros
+    if (i == 0) {
+        return 0;
+    }
+    if (i >= StatBuckets - 1 || (uint64_t)1 << i > h->max) {
+        return h->max;
+    }
+    return (uint64_t)1 << i;
+}
+
+// Writes every stage and its histogram.
+// Times are in microseconds.
+void stats_dump(Stats *s, FILE *f) {
+    StatHist *h;
+    int i, j;
+    fprintf(f, "stats over %.3f s\n", (stats_now() - s->since) / 1e9);
+    fprintf(f, "%-7s %10s %12s %10s %10s %10s %10s %12s\n",
+        "stage", "count", "total", "mean", "p50", "p99", "max", "bytes");
+    for (i = 0; i < StatStages; i++) {
+        h = &s->stages[i];
+        fprintf(f, "%-7s %10llu %12.0f %10.1f %10.1f %10.1f %10.1f %12llu\n",
+            stage_names[i], (unsigned long long)h->count,
+            h->sum / 1e3,
+            h->count ? h->sum / 1e3 / h->count : 0.0,
+            stats_percentile(h, 0.5) / 1e3,
+            stats_percentile(h, 0.99) / 1e3,
+            h->max / 1e3,
+            (unsigned long long)h->bytes);
+    }
+    for (i = 0; i < StatStages; i++) {
+        h = &s->stages[i];
+        if (h->count == 0) {
+            continue;
+        }
+        fprintf(f, "%s:", stage_names[i]);
+        for (j = 0; j < StatBuckets; j++) {
+            if (h->buckets[j] > 0) {
+                fprintf(f, " <%.3g:%llu", ((uint64_t)1 << j) / 1e3,
+                    (unsigned long long)h->buckets[j]);
+            }
+        }
+        fprintf(f, "\n");
+    }
+    fflush(f);
+}
+
+// Writes a few lines for showing on screen:
+// mean and max of each stage that has run, in microseconds.
+// Returns the length, like snprintf.
+int stats_summary(Stats *s, char *buf, size_t size) {
+    StatHist *h;
+    size_t len = 0;
+    int i, n;
+    buf[0] = '\0';
+    for (i = 0; i < StatStages; i++) {
+        h = &s->stages[i];
+        if (h->count == 0) {
+            continue;
+        }
+        n = snprintf(buf + len, size - len, "%s%-6s %8.1f %8.1f µs",
+            len > 0 ? "\n" : "", stage_names[i],
+            h->sum / 1e3 / h->count, h->max / 1e3);
+        if (n < 0 || (size_t)n >= size - len) {
+            break;
+        }
+        len += n;
+    }
+    return len;
+}
@@ -0,0 +1,49 @@
+//#include <stddef.h> /* size_t */
+//#include <stdio.h> /* FILE */
+//#include <stdint.h> /* uint64_t */
+
+// Stats:
+//   how long each stage of getting output onto the screen takes,
+//   as a count, a total and a histogram with power-of-two buckets
+//   cheap enough to always be on
+
+enum StatStage {
+    StatRead, // reading a pty
+    StatParse, // utf-8 checks and escape sequences, appending not included
+    StatAppend, // appending text to the scrollback
+    StatLayout, // blocks_update: wrapping new lines, shaping not included
+    StatShape, // pango shaping lines for a frame, on either thread
+    StatPaint, // drawing the damaged parts of a frame, on the render thread,
+               // shaping not included
+    StatFlush, // copying a finished frame to the window, and XFlush
+    StatEvent, // handling one X event
+    StatFrame, // getting a frame ready for the render thread
+    StatStages,
+};
+
+enum {
+    StatBuckets = 40, // bucket i holds times in [2^(i-1), 2^i) ns
+};
+
+typedef struct Stats Stats;
+typedef struct StatHist StatHist;
+
+struct StatHist {
+    uint64_t count;
+    uint64_t sum; // nanoseconds
+    uint64_t max;
+    uint64_t bytes; // for stages that move bytes around
+    uint64_t buckets[StatBuckets];
+};
+
+struct Stats {
+    StatHist stages[StatStages];
+    uint64_t since; // when they were last reset
+};
+
+void stats_init(Stats *s);
+uint64_t stats_now(void);
+void stats_add(Stats *s, int stage, uint64_t ns, size_t bytes);
+uint64_t stats_percentile(StatHist *h, double p);
+void stats_dump(Stats *s, FILE *f);
+int stats_summary(Stats *s, char *buf, size_t size);
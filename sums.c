@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "sums.h"
+
+void sums_init(Sums *s) {
+    s->tree = NULL;
+    s->n = 0;
+    s->cap = 0;
+}
+
+void sums_free(Sums *s) {
+    free(s->tree);
+    sums_init(s);
+}
+
+void sums_clear(Sums *s) {
+    s->n = 0;
+}
+
+// Returns the sum of values [0, i).
+long sums_prefix(Sums *s, int i) {
+    long sum = 0;
+    if (i > s->n) {
+        i = s->n;
+    }
+    for (; i > 0; i &= i - 1) {
+        sum += s->tree[i];
+    }
+    return sum;
+}
+
+// Appends a value. Node n only covers values up to n,
+// so it can be filled in from the ones before it.
+void sums_push(Sums *s, long value) {
+    int i;
+    if (s->n + 1 >= s->cap) {
+        void *v;
+        int newcap = s->cap * 2;
+        if (newcap == 0) {
+            newcap = 64;
+        }
+        if (newcap < s->cap) {
+            printf("sums: overflow\n");
+            exit(1);
+        }
+        v = realloc(s->tree, newcap * sizeof s->tree[0]);
+        if (v == NULL) {
+            perror("sums: realloc");
+            exit(1);
+        }
+        s->tree = v;
+        s->cap = newcap;
+    }
+    i = ++s->n;
+    s->tree[i] = value + sums_prefix(s, i - 1) - sums_prefix(s, i & (i - 1));
+}
+
+// Adds delta to value i.
+void sums_add(Sums *s, int i, long delta) {
+    for (i++; i <= s->n; i += i & -i) {
+        s->tree[i] += delta;
+    }
+}
+
+// Returns the index of the value that covers y,
+// i.e. the last i with sums_prefix(i) <= y, skipping zeros.
+// Returns n if y is past the total.
+int sums_find(Sums *s, long y) {
+    int i, step;
+    i = 0;
+    for (step = 1; step * 2 <= s->n; step *= 2) {
+    }
+    for (; step > 0; step /= 2) {
+        if (i + step <= s->n && s->tree[i + step] <= y) {
+            i += step;
+            y -= s->tree[i];
+        }
+    }
+    return i;
+}
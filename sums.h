@@ -0,0 +1,20 @@
+// Sums:
+//   running totals over a growing array of heights (a Fenwick tree)
+//   changing one, summing the first i and finding which one
+//   covers a given total each take O(log n)
+
+typedef struct Sums Sums;
+
+struct Sums {
+    long *tree; // tree[i] sums the lowbit(i) values ending at i, from 1
+    int n;
+    int cap;
+};
+
+void sums_init(Sums *s);
+void sums_free(Sums *s);
+void sums_clear(Sums *s);
+void sums_push(Sums *s, long value);
+void sums_add(Sums *s, int i, long delta);
+long sums_prefix(Sums *s, int i);
+int sums_find(Sums *s, long y);
@@ -3,6 +3,8 @@
 //   talks to the shell
 
 typedef struct Term Term;
+typedef struct TermPty TermPty;
+typedef struct TermOut TermOut;
 
 struct Term {
     // X stuff
@@ -19,9 +21,50 @@ struct Term {
     int border;
     bool dirty;
 
+    // damage tracking
+    cairo_region_t *damage; // parts of the window to repaint
+    cairo_rectangle_int_t inputrect; // where the input was drawn
+    int drawnscroll; // scroll position of the last frame
+    GC gc; // for copying pixels when scrolling
+
+    // frames are shaped and painted on the render thread
+    Render render;
+    Scene scene; // the frame it's drawing, or the last one
+    bool rendering; // the thread has the scene
+    bool framekey; // the frame answers input handled at framekeytime
+    struct timespec framekeytime;
+
     // shell
     Shell shell;
     bool exiting;
+    Pack pack; // compresses finished jobs' scrollback
+
+    // event loop
+    Loop loop;
+    int timerfd; // redraw timer
+    bool timer_armed;
+    struct timespec lastframe; // when we last showed a frame
+
+    // flood detection
+    size_t framebytes; // output taken in since the last frame
+    int heavyframes; // frames in a row with more than flood_bytes
+    bool flooding;
+
+    // keypress to flush latency
+    bool keypending; // input handled but not drawn yet
+    struct timespec keytime; // when it was handled
+    long nkeys;
+    long keysum; // microseconds
+    long keymax;
+
+    // per-stage timings
+    Stats stats;
+    uint64_t appendns; // time spent appending during the current parse
+    uint64_t shapens; // view_shapens when the last frame was handed over
+    size_t shapebytes;
+    bool showstats; // draw them over the window
+    PangoLayout *statslayout;
+    cairo_rectangle_int_t statsrect; // where they were drawn
 
     int cursor_pos; // cursor position in bytes
     int cursor_type; // cursor shape
@@ -30,15 +73,66 @@ struct Term {
     int inputx; // where the input is on the screen
     int inputy;
     int scroll; // scrollback y position in pixels
+    int width; // width of window
     int height; // height of window
 
     // edit buffer
-    char *edit;
-    int editlen;
-    int editcap;
-
-    // scrollback buffer
-    char *hist;
-    int histlen;
-    int histcap;
+    Edit edit;
+    char *inputtext; // the input in one piece, for pango
+    size_t inputcap;
+
+    // search
+    bool searching;
+    char find[HistFindMax]; // what's being searched for
+    int findlen;
+    int findblock; // block with the current match, -1 if none
+    size_t findoff; // where the match is in that job's history
+    bool findfailed; // the last search found nothing
+    PangoLayout *findlayout; // for the search bar
+    cairo_rectangle_int_t findrect; // where it was drawn
+
+    // paste
+    bool pasting; // waiting for (more of) a selection
+    bool pasteincr; // it's coming in pieces
+    bool pasteheld; // a piece is waiting for the queue to drain
+    TermPty *pastepty; // where it goes, NULL for the edit line
+    int pastetimer; // timerfd, fires if the owner stops sending
+
+    TermPty *ptys; // every open pty
+
+    // scrollback, one block per job
+    Blocks blocks;
+    Atlas atlas; // glyphs for drawing plain ascii lines
+
+    // pty input buffer
+    char *readbuf;
+    size_t readbufsize;
+    char *fixbuf; // readbuf with ill-formed sequences replaced
+};
+
+// A job's pty, as the terminal sees it:
+// what has to be kept between reads of its output.
+struct TermPty {
+    Term *term;
+    Job *job;
+    LoopHandler *handler;
+    Vt vt; // escape sequence parser
+    char partial[4]; // a utf-8 sequence cut off by the last read
+    size_t npartial;
+
+    // input for the job that the pty hasn't taken yet,
+    // written with writev once it's writable
+    TermOut *out;
+    int nout;
+    int outcap;
+    size_t outbytes;
+
+    TermPty *next; // in Term's list
+};
+
+struct TermOut {
+    char *buf;
+    size_t off; // written so far
+    size_t len;
+    size_t cap;
 };
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "utf8.h"
 
 // T0 0bbbbbbb
@@ -94,3 +95,220 @@ int utf8decodelast(char *buf, size_t buflen, int32_t *r) {
     }
     return _utf8decodelast((unsigned char*)buf, buflen, r);
 }
+
+// Bulk operations.
+//
+// Output from the shell is mostly ascii,
+// so these skip ascii runs 16 or 32 bytes at a time
+// and only look at multibyte sequences one by one.
+// The vector width is picked at runtime.
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define UTF8_X86 1
+#include <immintrin.h>
+#endif
+
+static size_t asciispan_scalar(const unsigned char *p, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (p[i] >= 0x80) {
+            break;
+        }
+    }
+    return i;
+}
+
+static size_t leadcount_scalar(const unsigned char *p, size_t n) {
+    size_t i, c = 0;
+    for (i = 0; i < n; i++) {
+        c += (p[i] & 0xC0) != 0x80;
+    }
+    return c;
+}
+
+#ifdef UTF8_X86
+static size_t asciispan_sse2(const unsigned char *p, size_t n) {
+    size_t i;
+    int m;
+    for (i = 0; i + 16 <= n; i += 16) {
+        m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p+i)));
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return i + asciispan_scalar(p+i, n-i);
+}
+
+// Lead bytes are the ones that aren't 10xxxxxx,
+// which as signed chars is everything above -65.
+static size_t leadcount_sse2(const unsigned char *p, size_t n) {
+    const __m128i cont = _mm_set1_epi8(-65);
+    size_t i, c = 0;
+    __m128i v;
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i*)(p+i));
+        c += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(v, cont)));
+    }
+    return c + leadcount_scalar(p+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static size_t asciispan_avx2(const unsigned char *p, size_t n) {
+    size_t i;
+    unsigned m;
+    for (i = 0; i + 32 <= n; i += 32) {
+        m = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(p+i)));
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return i + asciispan_sse2(p+i, n-i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t leadcount_avx2(const unsigned char *p, size_t n) {
+    const __m256i cont = _mm256_set1_epi8(-65);
+    size_t i, c = 0;
+    __m256i v;
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i*)(p+i));
+        c += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, cont)));
+    }
+    return c + leadcount_sse2(p+i, n-i);
+}
+#endif
+
+static size_t asciispan_init(const unsigned char *p, size_t n);
+static size_t leadcount_init(const unsigned char *p, size_t n);
+static size_t (*asciispan)(const unsigned char *p, size_t n) = asciispan_init;
+static size_t (*leadcount)(const unsigned char *p, size_t n) = leadcount_init;
+
+static void utf8_pickimpl(void) {
+    asciispan = asciispan_scalar;
+    leadcount = leadcount_scalar;
+#ifdef UTF8_X86
+    asciispan = asciispan_sse2;
+    leadcount = leadcount_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        asciispan = asciispan_avx2;
+        leadcount = leadcount_avx2;
+    }
+#endif
+}
+
+static size_t asciispan_init(const unsigned char *p, size_t n) {
+    utf8_pickimpl();
+    return asciispan(p, n);
+}
+
+static size_t leadcount_init(const unsigned char *p, size_t n) {
+    utf8_pickimpl();
+    return leadcount(p, n);
+}
+
+// Checks the sequence at the start of p (n > 0).
+// Returns its length if it's well-formed,
+// 0 if it's the start of a well-formed sequence that was cut off,
+// or -k if it's ill-formed, where k is the length of
+// the maximal subpart (which gets one replacement character).
+// Overlong forms, surrogates and anything above RuneMax are ill-formed.
+static int checkseq(const unsigned char *p, size_t n) {
+    unsigned int x = p[0];
+    unsigned int lo = 0x80, hi = 0xBF;
+    size_t i, len;
+
+    if (x < 0x80) {
+        return 1;
+    }
+    if (x < 0xC2 || x > 0xF4) {
+        return -1;
+    }
+    if (x < 0xE0) {
+        len = 2;
+    } else if (x < 0xF0) {
+        len = 3;
+        if (x == 0xE0) lo = 0xA0;
+        if (x == 0xED) hi = 0x9F;
+    } else {
+        len = 4;
+        if (x == 0xF0) lo = 0x90;
+        if (x == 0xF4) hi = 0x8F;
+    }
+    for (i = 1; i < len; i++) {
+        if (i == n) {
+            return 0;
+        }
+        if (p[i] < lo || p[i] > hi) {
+            return -(int)i;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    return len;
+}
+
+// Returns the length of the longest well-formed prefix of buf.
+// A sequence cut off at the end doesn't count.
+size_t utf8valid(char *buf, size_t buflen) {
+    unsigned char *p = (unsigned char*)buf;
+    size_t i = 0;
+    int k;
+    for (;;) {
+        i += asciispan(p+i, buflen-i);
+        if (i == buflen) {
+            return i;
+        }
+        k = checkseq(p+i, buflen-i);
+        if (k <= 0) {
+            return i;
+        }
+        i += k;
+    }
+}
+
+// Returns the length of buf without the sequence cut off at the end, if any.
+// The rest can be carried over and completed by the next read.
+size_t utf8complete(char *buf, size_t buflen) {
+    unsigned char *p = (unsigned char*)buf;
+    size_t i;
+    for (i = buflen; i > 0 && buflen - i < 4; i--) {
+        if ((p[i-1] & 0xC0) != 0x80) {
+            if (checkseq(p+i-1, buflen-i+1) == 0) {
+                return i-1;
+            }
+            break;
+        }
+    }
+    return buflen;
+}
+
+// Returns the number of code points in buf.
+// Each stray continuation byte is not counted on its own,
+// so this is only exact for well-formed text.
+size_t utf8count(char *buf, size_t buflen) {
+    return leadcount((unsigned char*)buf, buflen);
+}
+
+// Copies src to dst, replacing each ill-formed sequence with RuneError.
+// A sequence cut off at the end of src is replaced too.
+// dst must have room for 3*srclen bytes.
+// Returns the number of bytes written.
+size_t utf8fix(char *dst, char *src, size_t srclen) {
+    static const char repl[3] = "\xEF\xBF\xBD";
+    size_t i = 0, o = 0, n;
+    int k;
+    for (;;) {
+        n = utf8valid(src+i, srclen-i);
+        memmove(dst+o, src+i, n);
+        i += n;
+        o += n;
+        if (i == srclen) {
+            return o;
+        }
+        k = checkseq((unsigned char*)src+i, srclen-i);
+        i += k < 0 ? (size_t)-k : srclen-i;
+        memcpy(dst+o, repl, sizeof repl);
+        o += sizeof repl;
+    }
+}
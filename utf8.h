@@ -7,3 +7,8 @@ enum {
 
 int utf8decode(char *buf, size_t buflen, int32_t *r);
 int utf8decodelast(char *buf, size_t buflen, int32_t *r);
+
+size_t utf8valid(char *buf, size_t buflen);
+size_t utf8complete(char *buf, size_t buflen);
+size_t utf8count(char *buf, size_t buflen);
+size_t utf8fix(char *dst, char *src, size_t srclen);
@@ -0,0 +1,810 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <pango/pangocairo.h>
+#include "hist.h"
+#include "atlas.h"
+#include "sums.h"
+#include "render.h"
+#include "stats.h"
+#include "view.h"
+
+enum {
+    ViewCacheSize = 256, // shaped lines to keep around
+};
+
+// Shaped lines, shared by all views.
+// An entry is good as long as the line hasn't grown
+// and the font and width haven't changed.
+static struct {
+    View *v;
+    long line;
+    size_t len;
+    int gen;
+    PangoLayout *layout;
+    unsigned long used;
+} cache[ViewCacheSize];
+static unsigned long cacheclock;
+
+// Time spent shaping lines and how much was shaped, for the stats.
+static uint64_t shapens;
+static size_t shapebytes;
+
+// Bumped for every view and every change of font or width,
+// so that a generation names one view's layout of its lines.
+static int viewgen;
+
+// Views with groups loaded, most recently used first.
+// Only ViewHot of them keep any; the rest are let go.
+static View *hot[ViewHot];
+
+// scratch space for lines that straddle two chunks
+static char *scratch;
+static size_t scratchcap;
+
+static int view_estimate(View *v, size_t len);
+
+void view_init(View *v, Hist *h, PangoContext *context) {
+    v->hist = h;
+    v->context = context;
+    v->atlas = NULL;
+    v->font = NULL;
+    v->gen = ++viewgen;
+    v->width = -1;
+    v->charwidth = 1;
+    v->charheight = 1;
+    v->groups = NULL;
+    v->head = 0;
+    v->ngroups = 0;
+    v->groupcap = 0;
+    v->nloaded = 0;
+    v->clock = 0;
+    // Lines before this one are taken in as groups by view_update.
+    v->last = hist_lastline(h);
+    hist_line(h, v->last, &v->lastlen);
+    v->lastheight = view_estimate(v, v->lastlen);
+    v->height = abs(v->lastheight);
+    v->histstart = (size_t)-1;
+    v->histlen = (size_t)-1;
+    sums_init(&v->sums);
+    v->changed = 0;
+    v->flood = false;
+    v->markoff = 0;
+    v->marklen = 0;
+}
+
+// Lets go of the height of each line in a group. Its total stays.
+static void view_unload(View *v, ViewGroup *g) {
+    if (g->heights == NULL) {
+        return;
+    }
+    free(g->heights);
+    sums_free(&g->sums);
+    g->heights = NULL;
+    g->heightcap = 0;
+    v->nloaded--;
+}
+
+// Lets go of every group v has loaded.
+static void view_cool(View *v) {
+    int i;
+    for (i = v->head; i < v->ngroups && v->nloaded > 0; i++) {
+        view_unload(v, &v->groups[i]);
+    }
+}
+
+void view_free(View *v) {
+    int i;
+    for (i = 0; i < ViewCacheSize; i++) {
+        if (cache[i].v == v) {
+            cache[i].v = NULL;
+        }
+    }
+    for (i = 0; i < ViewHot; i++) {
+        if (hot[i] == v) {
+            memmove(hot+i, hot+i+1, (ViewHot-i-1) * sizeof hot[0]);
+            hot[ViewHot-1] = NULL;
+            break;
+        }
+    }
+    if (v->font != NULL) {
+        pango_font_description_free(v->font);
+    }
+    view_cool(v);
+    free(v->groups);
+    sums_free(&v->sums);
+    v->font = NULL;
+    v->groups = NULL;
+    v->head = 0;
+    v->ngroups = 0;
+    v->groupcap = 0;
+}
+
+// Guesses the height of a line from its length,
+// without laying it out.
+static int view_estimate(View *v, size_t len) {
+    double rows = 1;
+    if (v->width > 0 && len > 0) {
+        rows = ceil(len * v->charwidth / pango_units_to_double(v->width));
+        if (rows < 1) {
+            rows = 1;
+        }
+    }
+    return -(int)(rows * v->charheight + 0.5);
+}
+
+// Guesses the total height of nlines lines that take up len bytes,
+// without looking at them: each takes at least a row,
+// and they take as many rows as their text fills.
+static long view_estimategroup(View *v, int nlines, size_t len) {
+    double rows = nlines, fill;
+    if (v->width > 0 && nlines > 0) {
+        fill = ceil(len * v->charwidth / pango_units_to_double(v->width));
+        if (fill > rows) {
+            rows = fill;
+        }
+    }
+    return (long)(rows * v->charheight + 0.5);
+}
+
+static void view_markchanged(View *v, long y) {
+    if (v->changed < 0 || y < v->changed) {
+        v->changed = y;
+    }
+}
+
+// Moves v to the front of the hot list,
+// cooling whichever view falls off the end.
+static void view_touch(View *v) {
+    int i;
+    if (hot[0] == v) {
+        return;
+    }
+    for (i = 1; i < ViewHot-1; i++) {
+        if (hot[i] == v) {
+            break;
+        }
+    }
+    if (hot[i] != v && hot[i] != NULL) {
+        view_cool(hot[i]);
+    }
+    memmove(hot+1, hot, i * sizeof hot[0]);
+    hot[0] = v;
+}
+
+// Returns the first line the view holds.
+static long view_first(View *v) {
+    if (v->ngroups == v->head) {
+        return v->last;
+    }
+    return v->groups[v->head].line;
+}
+
+// Returns the index of the group a line ends in.
+// The line must be held, and not be the last.
+static int view_groupof(View *v, long line) {
+    int lo, hi, mid;
+    lo = v->head;
+    hi = v->ngroups;
+    while (hi - lo > 1) {
+        mid = lo + (hi-lo)/2;
+        if (v->groups[mid].line <= line) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Makes sure a group has the height of each of its lines.
+// Only ViewLoaded groups are loaded at once; the one looked at
+// longest ago is let go to make room, and whatever was learned
+// about its lines with it.
+// The lines are estimated afresh. If they add up to something
+// other than the group's total, everything after it moves.
+static void view_load(View *v, int gi) {
+    ViewGroup *g = &v->groups[gi];
+    size_t len;
+    long total;
+    int i, lru;
+
+    g->used = ++v->clock;
+    if (g->heights != NULL) {
+        return;
+    }
+    view_touch(v);
+    if (v->nloaded >= ViewLoaded) {
+        lru = -1;
+        for (i = v->head; i < v->ngroups; i++) {
+            if (v->groups[i].heights != NULL &&
+                (lru < 0 || v->groups[i].used < v->groups[lru].used)) {
+                lru = i;
+            }
+        }
+        view_unload(v, &v->groups[lru]);
+    }
+    g->heightcap = g->nlines > 0 ? g->nlines : 1;
+    g->heights = malloc(g->heightcap * sizeof g->heights[0]);
+    if (g->heights == NULL) {
+        perror("view: malloc");
+        exit(1);
+    }
+    sums_init(&g->sums);
+    v->nloaded++;
+    total = 0;
+    for (i = 0; i < g->nlines; i++) {
+        hist_line(v->hist, g->line + i, &len);
+        g->heights[i] = view_estimate(v, len);
+        total += abs(g->heights[i]);
+        sums_push(&g->sums, abs(g->heights[i]));
+    }
+    if (total != g->height) {
+        view_markchanged(v, sums_prefix(&v->sums, gi));
+        sums_add(&v->sums, gi, total - g->height);
+        v->height += total - g->height;
+        g->height = total;
+    }
+}
+
+// Returns the height of a line, negative if it's only an estimate.
+static int view_rawheight(View *v, long line) {
+    ViewGroup *g;
+    int gi;
+    if (line == v->last) {
+        return v->lastheight;
+    }
+    gi = view_groupof(v, line);
+    view_load(v, gi);
+    g = &v->groups[gi];
+    return g->heights[line - g->line];
+}
+
+static int view_lineheight(View *v, long line) {
+    return abs(view_rawheight(v, line));
+}
+
+static void view_setheight(View *v, long line, int height) {
+    ViewGroup *g;
+    int gi, i, d;
+    if (line == v->last) {
+        v->height += abs(height) - abs(v->lastheight);
+        v->lastheight = height;
+        return;
+    }
+    gi = view_groupof(v, line);
+    view_load(v, gi);
+    g = &v->groups[gi];
+    i = line - g->line;
+    d = abs(height) - abs(g->heights[i]);
+    g->heights[i] = height;
+    sums_add(&g->sums, i, d);
+    sums_add(&v->sums, gi, d);
+    g->height += d;
+    v->height += d;
+}
+
+// Rebuilds the running totals of the groups after they moved or changed.
+static void view_resum(View *v) {
+    int i;
+    sums_clear(&v->sums);
+    for (i = 0; i < v->ngroups; i++) {
+        sums_push(&v->sums, i < v->head ? 0 : v->groups[i].height);
+    }
+}
+
+// Returns the y position of a line, relative to the top of the view.
+static long view_top(View *v, long line) {
+    ViewGroup *g;
+    int gi;
+    if (line >= v->last) {
+        return v->height - abs(v->lastheight);
+    }
+    gi = view_groupof(v, line);
+    view_load(v, gi);
+    g = &v->groups[gi];
+    return sums_prefix(&v->sums, gi) + sums_prefix(&g->sums, line - g->line);
+}
+
+// Returns the line at y, or the first or last line if y is outside.
+static long view_lineat(View *v, long y) {
+    ViewGroup *g;
+    long top;
+    int gi, i;
+    if (y < 0) {
+        y = 0;
+    }
+    for (;;) {
+        gi = sums_find(&v->sums, y);
+        if (gi < v->head) {
+            gi = v->head;
+        }
+        if (gi >= v->ngroups) {
+            return v->last;
+        }
+        view_load(v, gi);
+        g = &v->groups[gi];
+        top = sums_prefix(&v->sums, gi);
+        // loading may have made the group shorter than y
+        if (y < top + g->height || g->nlines == 0) {
+            break;
+        }
+    }
+    if (g->nlines == 0) {
+        return v->last;
+    }
+    i = sums_find(&g->sums, y - top);
+    if (i > g->nlines - 1) {
+        i = g->nlines - 1;
+    }
+    return g->line + i;
+}
+
+// Starts a group for the chunk at off, whose first line is line.
+static void view_addgroup(View *v, long line, size_t off) {
+    ViewGroup *g;
+    if (v->ngroups == v->groupcap && v->head > 0) {
+        memmove(v->groups, v->groups+v->head, (v->ngroups-v->head) * sizeof v->groups[0]);
+        v->ngroups -= v->head;
+        v->head = 0;
+        view_resum(v);
+    }
+    if (v->ngroups == v->groupcap) {
+        void *p;
+        int newcap;
+        newcap = v->groupcap * 2;
+        if (newcap == 0) {
+            newcap = 16;
+        }
+        if (newcap < v->groupcap) {
+            printf("view: overflow\n");
+            exit(1);
+        }
+        p = realloc(v->groups, newcap * sizeof v->groups[0]);
+        if (p == NULL) {
+            perror("view: realloc");
+            exit(1);
+        }
+        v->groups = p;
+        v->groupcap = newcap;
+    }
+    g = &v->groups[v->ngroups];
+    g->off = off;
+    g->line = line;
+    g->nlines = 0;
+    g->height = 0;
+    g->heights = NULL;
+    g->heightcap = 0;
+    sums_init(&g->sums);
+    g->used = 0;
+    v->ngroups++;
+    sums_push(&v->sums, 0);
+}
+
+// Adds a line to the last group.
+// Only a loaded group keeps the height of each line.
+static void view_addline(View *v, int height) {
+    ViewGroup *g = &v->groups[v->ngroups-1];
+    if (g->heights != NULL) {
+        if (g->nlines == g->heightcap) {
+            void *p;
+            int newcap = g->heightcap * 2;
+            if (newcap < g->heightcap) {
+                printf("view: overflow\n");
+                exit(1);
+            }
+            p = realloc(g->heights, newcap * sizeof g->heights[0]);
+            if (p == NULL) {
+                perror("view: realloc");
+                exit(1);
+            }
+            g->heights = p;
+            g->heightcap = newcap;
+        }
+        g->heights[g->nlines] = height;
+        sums_push(&g->sums, abs(height));
+    }
+    g->nlines++;
+    g->height += abs(height);
+    sums_add(&v->sums, v->ngroups-1, abs(height));
+    v->height += abs(height);
+}
+
+// Throws away all the heights we know.
+// Groups get a guess from their size, without looking at their lines;
+// they're estimated line by line when they're looked at.
+static void view_reset(View *v) {
+    ViewGroup *g;
+    size_t end, len;
+    int i;
+    v->gen = ++viewgen;
+    v->height = 0;
+    v->changed = 0;
+    view_cool(v);
+    for (i = v->head; i < v->ngroups; i++) {
+        g = &v->groups[i];
+        end = i+1 < v->ngroups ? v->groups[i+1].off : v->hist->len;
+        g->height = view_estimategroup(v, g->nlines, end - g->off);
+        v->height += g->height;
+    }
+    hist_line(v->hist, v->last, &len);
+    v->lastheight = view_estimate(v, len);
+    v->height += abs(v->lastheight);
+    view_resum(v);
+}
+
+void view_setfont(View *v, const PangoFontDescription *font, double charwidth, double charheight) {
+    if (v->font != NULL) {
+        pango_font_description_free(v->font);
+    }
+    v->font = pango_font_description_copy(font);
+    v->charwidth = charwidth;
+    v->charheight = charheight;
+    view_reset(v);
+}
+
+void view_setwidth(View *v, int width) {
+    if (width == v->width) {
+        return;
+    }
+    v->width = width;
+    view_reset(v);
+}
+
+// While output floods in, new lines aren't looked at:
+// each one but the last is guessed to be a single row.
+// Lines that do get drawn are laid out and corrected then,
+// so lines that scroll by unseen cost next to nothing.
+void view_setflood(View *v, bool flood) {
+    v->flood = flood;
+}
+
+// Catches up with lines added to (or dropped from) the history.
+// Returns the number of pixels that were dropped off the top.
+// Where the view starts to look different is left in v->changed.
+long view_update(View *v) {
+    Hist *h = v->hist;
+    ViewGroup *g;
+    size_t start, off, len;
+    long dropped, line, end, last, oldlast;
+    int i, n, nchunks, row, height, oldheight;
+
+    // Every expanded view is updated every frame, and most
+    // of the histories haven't changed since the last one
+    if (h->len == v->histlen && h->start == v->histstart) {
+        return 0;
+    }
+    v->histlen = h->len;
+    v->histstart = h->start;
+
+    // Drop the groups of chunks the history has let go of
+    nchunks = hist_nchunks(h);
+    start = (size_t)-1;
+    if (nchunks > 0) {
+        hist_chunklines(h, 0, &n, &start);
+    }
+    dropped = 0;
+    while (v->head < v->ngroups && v->groups[v->head].off < start) {
+        g = &v->groups[v->head];
+        dropped += g->height;
+        sums_add(&v->sums, v->head, -g->height);
+        view_unload(v, g);
+        v->head++;
+    }
+    v->height -= dropped;
+    if (dropped > 0) {
+        view_markchanged(v, 0);
+    }
+    if (v->head == v->ngroups) {
+        v->head = 0;
+        v->ngroups = 0;
+        sums_clear(&v->sums);
+    }
+
+    // The line that was being written may have grown since, or ended
+    last = hist_lastline(h);
+    hist_line(h, v->last, &len);
+    if (len != v->lastlen) {
+        view_markchanged(v, v->height - abs(v->lastheight));
+        view_setheight(v, v->last, view_estimate(v, len));
+    } else if (v->last < last) {
+        view_markchanged(v, v->height);
+    }
+    oldlast = v->last;
+    oldheight = v->lastheight;
+    if (last != oldlast) {
+        // it goes into a group below
+        v->height -= abs(v->lastheight);
+    }
+
+    // Lines that ended since go into the group of the chunk
+    // they ended in; the last group we had may have grown.
+    // Groups line up with the chunks from groups[head].
+    row = view_estimate(v, 0);
+    i = v->ngroups - v->head;
+    if (i > 0) {
+        i--;
+    }
+    for (; i < nchunks; i++) {
+        line = hist_chunklines(h, i, &n, &off);
+        if (v->head + i == v->ngroups) {
+            view_addgroup(v, line, off);
+        }
+        end = line + n;
+        for (line += v->groups[v->head + i].nlines; line < end; line++) {
+            if (line == oldlast) {
+                height = oldheight;
+            } else if (v->flood) {
+                height = row;
+            } else {
+                hist_line(h, line, &len);
+                height = view_estimate(v, len);
+            }
+            view_addline(v, height);
+        }
+    }
+    if (last != oldlast) {
+        v->last = last;
+        hist_line(h, last, &len);
+        v->lastheight = view_estimate(v, len);
+        v->height += abs(v->lastheight);
+    }
+    hist_line(h, last, &v->lastlen);
+    return dropped;
+}
+
+long view_height(View *v) {
+    return v->height;
+}
+
+// Returns the y position from which the view has changed
+// since the last call, or -1 if it hasn't.
+long view_changed(View *v) {
+    long y = v->changed;
+    v->changed = -1;
+    return y;
+}
+
+// Returns the height without the last line if it's empty,
+// i.e. if the text ends in a newline.
+long view_trimheight(View *v) {
+    if (v->lastlen != 0) {
+        return v->height;
+    }
+    return v->height - abs(v->lastheight);
+}
+
+// Draws lines from the atlas when it can, instead of with pango.
+// The atlas must be set to the same font as the view.
+void view_setatlas(View *v, Atlas *atlas) {
+    v->atlas = atlas;
+}
+
+// Returns the text of a line, copying it out if it straddles two chunks.
+static char* view_text(View *v, size_t off, size_t len) {
+    size_t avail;
+    char *p;
+    p = hist_ptr(v->hist, off, &avail);
+    if (avail < len) {
+        if (scratchcap < len) {
+            void *s = realloc(scratch, len);
+            if (s == NULL) {
+                perror("view: realloc");
+                exit(1);
+            }
+            scratch = s;
+            scratchcap = len;
+        }
+        hist_read(v->hist, off, scratch, len);
+        p = scratch;
+    }
+    if (p == NULL) {
+        p = "";
+    }
+    return p;
+}
+
+// Returns the layout for a line, shaping it if necessary.
+static PangoLayout* view_layout(View *v, long line) {
+    PangoLayout *layout;
+    size_t off, len;
+    uint64_t start;
+    char *p;
+    int i, lru, height;
+
+    off = hist_line(v->hist, line, &len);
+    lru = 0;
+    for (i = 0; i < ViewCacheSize; i++) {
+        if (cache[i].v == v && cache[i].line == line) {
+            if (cache[i].len == len && cache[i].gen == v->gen) {
+                cache[i].used = ++cacheclock;
+                return cache[i].layout;
+            }
+            lru = i;
+            break;
+        }
+        if (cache[i].used < cache[lru].used) {
+            lru = i;
+        }
+    }
+
+    layout = cache[lru].layout;
+    if (layout != NULL && pango_layout_get_context(layout) != v->context) {
+        g_object_unref(layout);
+        layout = NULL;
+    }
+    if (layout == NULL) {
+        layout = pango_layout_new(v->context);
+        pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
+    }
+    pango_layout_set_font_description(layout, v->font);
+    pango_layout_set_width(layout, v->width);
+
+    p = view_text(v, off, len);
+    start = stats_now();
+    pango_layout_set_text(layout, p, len);
+    pango_layout_get_pixel_size(layout, NULL, &height);
+    shapens += stats_now() - start;
+    shapebytes += len;
+    view_setheight(v, line, height);
+
+    cache[lru].v = v;
+    cache[lru].line = line;
+    cache[lru].len = len;
+    cache[lru].gen = v->gen;
+    cache[lru].layout = layout;
+    cache[lru].used = ++cacheclock;
+    return layout;
+}
+
+// Returns how long views have spent shaping lines so far,
+// and how many bytes they shaped in *bytes.
+uint64_t view_shapens(size_t *bytes) {
+    *bytes = shapebytes;
+    return shapens;
+}
+
+// Lays out a line to find its real height, if it isn't known yet.
+static void view_measure(View *v, long line) {
+    size_t off, len;
+    char *p;
+    if (view_rawheight(v, line) >= 0) {
+        return;
+    }
+    if (v->atlas != NULL) {
+        off = hist_line(v->hist, line, &len);
+        p = view_text(v, off, len);
+        if (atlas_fits(v->atlas, p, len, v->width)) {
+            view_setheight(v, line, atlas_lineheight(v->atlas));
+            return;
+        }
+    }
+    view_layout(v, line);
+}
+
+// Returns the y position of a line, relative to the top of the view.
+// The line and the lines that fit in the given number of pixels
+// above it are laid out first, so drawing them won't move it.
+long view_liney(View *v, long line, int above) {
+    long first, last, l, h;
+    first = view_first(v);
+    last = v->last;
+    if (line < first) {
+        line = first;
+    }
+    if (line > last) {
+        line = last;
+    }
+    view_measure(v, line);
+    h = 0;
+    for (l = line - 1; l >= first && h < above; l--) {
+        view_measure(v, l);
+        h += view_lineheight(v, l);
+    }
+    return view_top(v, line);
+}
+
+// Highlights len bytes of the history from off, or nothing if len is 0.
+// Where it was and where it is now are marked as changed.
+void view_setmark(View *v, size_t off, size_t len) {
+    if (v->marklen > 0) {
+        view_markchanged(v, view_liney(v, hist_lineat(v->hist, v->markoff), 0));
+    }
+    v->markoff = off;
+    v->marklen = len;
+    if (len > 0) {
+        view_markchanged(v, view_liney(v, hist_lineat(v->hist, off), 0));
+    }
+}
+
+// Copies the lines that fall between 0 and height on the screen
+// into the scene, with the top of the view at y.
+// Lines outside the damage are left out.
+// Lines that fit the atlas get their height here; the rest
+// keep their guess until the frame comes back (view_measured).
+// Returns true if looking at the lines moved any of them,
+// which is left in v->changed for the next frame.
+bool view_snap(View *v, Scene *s, long y, int height) {
+    cairo_rectangle_int_t ext;
+    SceneItem *it;
+    size_t off, len;
+    char *p;
+    long ly, line, was;
+    int raw;
+
+    was = v->changed;
+    cairo_region_get_extents(s->damage, &ext);
+    if (ext.y + ext.height < height) {
+        height = ext.y + ext.height;
+    }
+    if (ext.y < 0) {
+        ext.y = 0;
+    }
+    line = view_lineat(v, ext.y - y);
+    ly = view_top(v, line);
+    for (; line <= v->last && y + ly < height; line++) {
+        // loading the line's group looks at other lines,
+        // so it comes before getting at this one's text
+        raw = view_rawheight(v, line);
+        off = hist_line(v->hist, line, &len);
+        p = view_text(v, off, len);
+        if (v->atlas != NULL && atlas_fits(v->atlas, p, len, v->width)) {
+            it = scene_add(s, SceneSimple, p, len, y + ly, atlas_lineheight(v->atlas));
+            view_setheight(v, line, atlas_lineheight(v->atlas));
+        } else {
+            it = scene_add(s, SceneLine, p, len, y + ly, raw);
+        }
+        it->gen = v->gen;
+        it->line = line;
+        if (v->marklen > 0 && v->markoff + v->marklen > off && v->markoff <= off + len) {
+            it->markstart = v->markoff > off ? v->markoff - off : 0;
+            it->markend = v->markoff + v->marklen - off;
+            if (it->markend > len) {
+                it->markend = len;
+            }
+        }
+        ly += view_lineheight(v, line);
+    }
+    return v->changed != was;
+}
+
+// Takes the height a frame found for a line that was only guessed,
+// if the line hasn't changed since and isn't known by now.
+// Returns true if the lines after it moved.
+bool view_measured(View *v, int gen, long line, size_t len, int height) {
+    size_t cur;
+    long was;
+    int old;
+    if (gen != v->gen || line < view_first(v) || line > v->last) {
+        return false;
+    }
+    was = v->changed;
+    if (view_rawheight(v, line) < 0) {
+        hist_line(v->hist, line, &cur);
+        if (cur == len) {
+            old = view_lineheight(v, line);
+            view_setheight(v, line, height);
+            if (height != old) {
+                view_markchanged(v, view_top(v, line));
+            }
+        }
+    }
+    return v->changed != was;
+}
+
+// Finds where the end of the last line is, relative to the top of the view.
+void view_endpos(View *v, int *x, int *y) {
+    PangoLayout *layout;
+    PangoRectangle rect;
+    size_t len;
+
+    layout = view_layout(v, v->last);
+    hist_line(v->hist, v->last, &len);
+    pango_layout_index_to_pos(layout, len, &rect);
+    pango_extents_to_pixels(NULL, &rect);
+    *x = rect.x;
+    *y = v->height - abs(v->lastheight) + rect.y;
+}
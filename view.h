@@ -0,0 +1,99 @@
+//#include <stdbool.h> /* bool */
+//#include <stdint.h> /* uint64_t */
+//#include <pango/pangocairo.h>
+//#include "hist.h"
+//#include "atlas.h"
+//#include "sums.h"
+//#include "render.h"
+
+// View:
+//   lays out a Hist one line at a time,
+//   shaping only the lines that are on screen
+//   (lines being drawn are shaped by the render thread)
+//   lines are grouped by the chunk they end in; only each group's
+//   total height is kept for good, and the height of each line
+//   only while the group is being looked at
+
+enum {
+    ViewLoaded = 4, // groups to keep each line's height for at once
+    ViewHot = 8, // views that keep any
+};
+
+typedef struct View View;
+typedef struct ViewGroup ViewGroup;
+
+// The lines that end in one chunk of the history.
+struct ViewGroup {
+    size_t off; // where the chunk starts in the history
+    long line; // number of its first line
+    int nlines;
+    long height; // total, in pixels
+
+    // height of each line in pixels, NULL if not loaded;
+    // negative if the line hasn't been laid out yet
+    // and the height is only an estimate
+    int *heights;
+    int heightcap;
+    Sums sums; // running totals of heights[]
+    unsigned long used; // when it was last looked at
+};
+
+struct View {
+    Hist *hist;
+    PangoContext *context;
+    Atlas *atlas; // for drawing simple lines, or NULL
+    PangoFontDescription *font;
+    int gen; // changes with the font or width, unique to the view
+    int width; // wrap width in pango units
+    double charwidth;
+    double charheight;
+
+    // one group per chunk of the history
+    ViewGroup *groups;
+    int head; // index of the oldest group still held
+    int ngroups;
+    int groupcap;
+    int nloaded; // groups with heights[]
+    unsigned long clock;
+
+    // the line being written, which doesn't end in any chunk yet
+    long last;
+    int lastheight; // negative if it's only an estimate
+    size_t lastlen; // its length when we last looked
+
+    // the history's start and end at the last view_update;
+    // if neither moved there's nothing to catch up with
+    size_t histstart;
+    size_t histlen;
+
+    long height; // total height in pixels
+
+    // running totals of the group heights, so that finding
+    // the line at a y or the y of a line takes O(log n)
+    // groups dropped off the front count as zero
+    Sums sums;
+
+    long changed; // y of the first pixel that changed, -1 if none
+    bool flood; // output is pouring in; guess new lines are one row
+
+    // a highlighted range of the history, such as a search match
+    size_t markoff;
+    size_t marklen; // 0 if nothing is highlighted
+};
+
+void view_init(View *v, Hist *h, PangoContext *context);
+void view_free(View *v);
+void view_setatlas(View *v, Atlas *atlas);
+void view_setfont(View *v, const PangoFontDescription *font, double charwidth, double charheight);
+void view_setwidth(View *v, int width);
+void view_setflood(View *v, bool flood);
+long view_update(View *v);
+long view_height(View *v);
+long view_trimheight(View *v);
+long view_changed(View *v);
+void view_setmark(View *v, size_t off, size_t len);
+long view_liney(View *v, long line, int above);
+bool view_snap(View *v, Scene *s, long y, int height);
+bool view_measured(View *v, int gen, long line, size_t len, int height);
+void view_endpos(View *v, int *x, int *y);
+uint64_t view_shapens(size_t *bytes);
@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vt.h"
+
+// A simplified version of the DEC parser state machine
+// described at https://vt100.net/emu/dec_ansi_parser
+
+enum {
+    Ground,
+    Escape,
+    EscapeInter,
+    CsiParam,
+    CsiInter,
+    CsiIgnore,
+    OscString,
+    OscEscape, // saw ESC inside an OSC string
+    String, // DCS, SOS, PM, APC: ignored
+    StringEscape,
+};
+
+enum {
+    CAN = 0x18,
+    SUB = 0x1A,
+    ESC = 0x1B,
+    DEL = 0x7F,
+};
+
+// Finding the end of a run of text.
+//
+// Text is anything but C0 controls and DEL,
+// except that newline and tab count as text.
+// The vector width is picked at runtime, as in utf8.c.
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define VT_X86 1
+#include <immintrin.h>
+#endif
+
+static int istext(unsigned char c) {
+    return (c >= 0x20 && c != DEL) || c == '\n' || c == '\t';
+}
+
+static size_t textspan_scalar(const unsigned char *p, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (!istext(p[i])) {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef VT_X86
+static size_t textspan_sse2(const unsigned char *p, size_t n) {
+    const __m128i c0 = _mm_set1_epi8(0x1F);
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i del = _mm_set1_epi8(DEL);
+    __m128i v, ctl, ok;
+    size_t i;
+    int m;
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i*)(p+i));
+        ctl = _mm_cmpeq_epi8(_mm_max_epu8(v, c0), c0); // v <= 0x1F
+        ok = _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, tab));
+        ctl = _mm_or_si128(_mm_andnot_si128(ok, ctl), _mm_cmpeq_epi8(v, del));
+        m = _mm_movemask_epi8(ctl);
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return i + textspan_scalar(p+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static size_t textspan_avx2(const unsigned char *p, size_t n) {
+    const __m256i c0 = _mm256_set1_epi8(0x1F);
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(DEL);
+    __m256i v, ctl, ok;
+    size_t i;
+    unsigned m;
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i*)(p+i));
+        ctl = _mm256_cmpeq_epi8(_mm256_max_epu8(v, c0), c0);
+        ok = _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, tab));
+        ctl = _mm256_or_si256(_mm256_andnot_si256(ok, ctl), _mm256_cmpeq_epi8(v, del));
+        m = _mm256_movemask_epi8(ctl);
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+    return i + textspan_sse2(p+i, n-i);
+}
+#endif
+
+static size_t textspan_init(const unsigned char *p, size_t n);
+static size_t (*textspan)(const unsigned char *p, size_t n) = textspan_init;
+
+static size_t textspan_init(const unsigned char *p, size_t n) {
+    textspan = textspan_scalar;
+#ifdef VT_X86
+    textspan = textspan_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        textspan = textspan_avx2;
+    }
+#endif
+    return textspan(p, n);
+}
+
+void vt_init(Vt *vt, VtFunc *fn, void *arg) {
+    memset(vt, 0, sizeof *vt);
+    vt->state = Ground;
+    vt->fn = fn;
+    vt->arg = arg;
+}
+
+static void vt_emit(Vt *vt, int type, int final) {
+    vt->seq.type = type;
+    vt->seq.final = final;
+    vt->fn(vt->arg, &vt->seq);
+}
+
+static void vt_control(Vt *vt, int c) {
+    VtAction a;
+    a.type = VtControl;
+    a.final = c;
+    vt->fn(vt->arg, &a);
+}
+
+static void vt_text(Vt *vt, char *s, size_t len) {
+    VtAction a;
+    a.type = VtText;
+    a.s = s;
+    a.len = len;
+    vt->fn(vt->arg, &a);
+}
+
+// Starts a new sequence.
+static void vt_clear(Vt *vt, int state) {
+    vt->state = state;
+    vt->seq.private = 0;
+    vt->seq.ninter = 0;
+    vt->seq.nparams = 0;
+    vt->subskip = 0;
+    vt->seq.s = NULL;
+    vt->seq.len = 0;
+    vt->osclen = 0;
+}
+
+static void vt_inter(Vt *vt, int c) {
+    if (vt->seq.ninter < VtMaxInter) {
+        vt->seq.inter[vt->seq.ninter++] = c;
+    }
+}
+
+static void vt_addparam(VtAction *s) {
+    s->params[s->nparams] = -1;
+    s->nsubs[s->nparams] = 0;
+    s->nparams++;
+}
+
+// Takes a digit, ';' or ':'. Parameters are split by ';',
+// and ':' splits a parameter into subparameters, as in 38:2::r:g:b.
+static void vt_param(Vt *vt, int c) {
+    VtAction *s = &vt->seq;
+    int *p, *n;
+    if (s->nparams == 0) {
+        vt_addparam(s);
+    }
+    if (c == ';') {
+        if (s->nparams < VtMaxParams) {
+            vt_addparam(s);
+        }
+        vt->subskip = 0;
+        return;
+    }
+    n = &s->nsubs[s->nparams-1];
+    if (c == ':') {
+        if (*n < VtMaxSubs) {
+            s->subs[s->nparams-1][(*n)++] = -1;
+        } else {
+            vt->subskip = 1;
+        }
+        return;
+    }
+    if (vt->subskip) {
+        return;
+    }
+    if (*n > 0) {
+        p = &s->subs[s->nparams-1][*n-1];
+    } else {
+        p = &s->params[s->nparams-1];
+    }
+    if (*p < 0) {
+        *p = 0;
+    }
+    if (*p < 65536) {
+        *p = *p*10 + (c - '0');
+    }
+}
+
+static void vt_osc(Vt *vt) {
+    vt->seq.s = vt->osc;
+    vt->seq.len = vt->osclen;
+    vt_emit(vt, VtOsc, 0);
+}
+
+// Feeds one byte of a sequence to the state machine.
+static void vt_byte(Vt *vt, int c) {
+    // Things that apply in any state
+    switch (vt->state) {
+    case OscString:
+        if (c == '\a') {
+            vt_osc(vt);
+            vt->state = Ground;
+        } else if (c == ESC) {
+            vt->state = OscEscape;
+        } else if (c == CAN || c == SUB) {
+            vt->state = Ground;
+        } else if (c >= 0x20 && vt->osclen < sizeof vt->osc) {
+            vt->osc[vt->osclen++] = c;
+        }
+        return;
+    case OscEscape:
+        vt_osc(vt);
+        if (c == '\\') {
+            vt->state = Ground;
+            return;
+        }
+        vt_clear(vt, Escape);
+        break;
+    case String:
+        if (c == ESC) {
+            vt->state = StringEscape;
+        } else if (c == CAN || c == SUB) {
+            vt->state = Ground;
+        }
+        return;
+    case StringEscape:
+        if (c == '\\') {
+            vt->state = Ground;
+            return;
+        }
+        vt_clear(vt, Escape);
+        break;
+    }
+
+    if (c == ESC) {
+        vt_clear(vt, Escape);
+        return;
+    }
+    if (c == CAN || c == SUB) {
+        vt->state = Ground;
+        return;
+    }
+    if (c < 0x20) {
+        // Controls are carried out in the middle of a sequence
+        vt_control(vt, c);
+        return;
+    }
+    if (c >= DEL) {
+        return;
+    }
+
+    switch (vt->state) {
+    case Escape:
+        if (c < 0x30) {
+            vt_inter(vt, c);
+            vt->state = EscapeInter;
+        } else if (c == '[') {
+            vt_clear(vt, CsiParam);
+        } else if (c == ']') {
+            vt_clear(vt, OscString);
+        } else if (c == 'P' || c == 'X' || c == '^' || c == '_') {
+            vt->state = String;
+        } else {
+            vt_emit(vt, VtEsc, c);
+            vt->state = Ground;
+        }
+        break;
+    case EscapeInter:
+        if (c < 0x30) {
+            vt_inter(vt, c);
+        } else {
+            vt_emit(vt, VtEsc, c);
+            vt->state = Ground;
+        }
+        break;
+    case CsiParam:
+        if (c < 0x30) {
+            vt_inter(vt, c);
+            vt->state = CsiInter;
+        } else if (c < 0x3C) {
+            vt_param(vt, c);
+        } else if (c < 0x40) {
+            if (vt->seq.nparams == 0 && vt->seq.private == 0) {
+                vt->seq.private = c;
+            } else {
+                vt->state = CsiIgnore;
+            }
+        } else {
+            vt_emit(vt, VtCsi, c);
+            vt->state = Ground;
+        }
+        break;
+    case CsiInter:
+        if (c < 0x30) {
+            vt_inter(vt, c);
+        } else if (c < 0x40) {
+            vt->state = CsiIgnore;
+        } else {
+            vt_emit(vt, VtCsi, c);
+            vt->state = Ground;
+        }
+        break;
+    case CsiIgnore:
+        if (c >= 0x40) {
+            vt->state = Ground;
+        }
+        break;
+    }
+}
+
+// Parses buf and calls vt->fn for each piece.
+// Text is passed as pointers into buf.
+// A sequence that doesn't end in buf is finished by the next call.
+void vt_parse(Vt *vt, char *buf, size_t len) {
+    const unsigned char *p = (const unsigned char*)buf;
+    size_t i = 0, n;
+    int c;
+
+    while (i < len) {
+        if (vt->state != Ground) {
+            vt_byte(vt, p[i++]);
+            continue;
+        }
+        n = textspan(p+i, len-i);
+        if (n > 0) {
+            vt_text(vt, buf+i, n);
+            i += n;
+            if (i == len) {
+                break;
+            }
+        }
+        c = p[i++];
+        if (c == ESC) {
+            vt_clear(vt, Escape);
+        } else if (c != DEL && c != CAN && c != SUB) {
+            vt_control(vt, c);
+        }
+    }
+}
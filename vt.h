@@ -0,0 +1,53 @@
+//#include <stddef.h> /* size_t */
+
+// Vt:
+//   splits terminal output into text and control sequences
+//   keeps its state between calls,
+//   so a sequence can be split across reads
+
+enum {
+    VtMaxParams = 16,
+    VtMaxSubs = 5, // after a colon, enough for 38:2::r:g:b
+    VtMaxInter = 2,
+    VtMaxOsc = 512,
+};
+
+// Action types
+enum {
+    VtText, // plain text, including newlines and tabs: s, len
+    VtControl, // any other C0 control character: final
+    VtEsc, // ESC sequence: inter, final
+    VtCsi, // ESC [ sequence: private, params, subs, inter, final
+    VtOsc, // ESC ] string: s, len
+};
+
+typedef struct Vt Vt;
+typedef struct VtAction VtAction;
+typedef void VtFunc(void *arg, VtAction *a);
+
+struct VtAction {
+    int type;
+    int final; // final byte or control character
+    char *s; // VtText, VtOsc
+    size_t len;
+    int private; // '<' to '?' at the start of a CSI, 0 if none
+    char inter[VtMaxInter]; // intermediate bytes
+    int ninter;
+    int params[VtMaxParams]; // -1 = omitted
+    int nparams;
+    int subs[VtMaxParams][VtMaxSubs]; // the subparameters after each, -1 = omitted
+    int nsubs[VtMaxParams];
+};
+
+struct Vt {
+    int state;
+    VtAction seq; // sequence being parsed
+    char osc[VtMaxOsc];
+    size_t osclen;
+    int subskip; // past VtMaxSubs subparameters, until the next ';'
+    VtFunc *fn; // called for each action
+    void *arg;
+};
+
+void vt_init(Vt *vt, VtFunc *fn, void *arg);
+void vt_parse(Vt *vt, char *buf, size_t len);